@@ -0,0 +1,481 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <array>
+
+#include "PhysicsSystem.h"
+#include "Player.h"
+#include "Terrain.h"
+
+/*
+ * Headless benchmarks of the physics hot paths on synthetic scenes.
+ * Every benchmark is run for a number of iterations, each iteration is timed as one sample.
+ * Results are printed as a table, or as one JSON object per line with --json.
+ *
+ * Usage: physics_bench [--count N] [--iterations N] [--distribution uniform|clustered|piled|all]
+ *                      [--seed N] [--workers N] [--filter name] [--json]
+ */
+
+enum Distribution : uint8_t {
+    UNIFORM,    // Spread evenly through a cube, few overlaps
+    CLUSTERED,  // Dense groups with empty space between them
+    PILED,      // Columns of objects resting on each other
+    DISTRIBUTION_COUNT
+};
+
+static const char *distribution_names[DISTRIBUTION_COUNT] = {"uniform", "clustered", "piled"};
+
+struct BenchConfig {
+    uint32_t count = 1000;
+    uint32_t iterations = 50;
+    uint32_t seed = 1;
+    uint32_t workers = 0;
+    int distribution = -1;      // -1 runs every distribution
+    std::string filter;
+    bool json = false;
+};
+
+/*
+ * Shapes of a scene, the containers are reserved up front so pointers stay valid
+ */
+struct BenchScene {
+    std::vector<Sphere> spheres;
+    std::vector<Box> boxes;
+    std::vector<Capsule> capsules;
+    std::vector<CollisionShape*> shapes;
+    std::vector<AABB> aabbs;
+    std::vector<ObjectID> oids;
+};
+
+typedef std::chrono::steady_clock BenchClock;
+typedef std::array<float, 3> BenchPos;
+
+static inline double elapsed_us( BenchClock::time_point start ){
+    return std::chrono::duration<double, std::micro>( BenchClock::now() - start ).count();
+}
+
+/*
+ * Positions for count objects, every distribution is about the same volume per object
+ */
+static void place( Distribution distribution, uint32_t count, std::mt19937 &rng, std::vector<BenchPos> &positions ){
+    std::uniform_real_distribution<float> unit( 0, 1 );
+    float side = cbrtf( (float)count ) * 3;
+    positions.resize( count );
+
+    switch( distribution ){
+        case UNIFORM:
+            for( BenchPos &p : positions )
+                p = { unit(rng) * side, unit(rng) * side, unit(rng) * side };
+            break;
+
+        case CLUSTERED: {
+            // Groups of 32 around centers spread through the same volume
+            std::normal_distribution<float> spread( 0, 1.5f );
+            BenchPos center = {};
+            for( uint32_t i = 0; i < count; ++i ){
+                if( i % 32 == 0 )
+                    center = { unit(rng) * side, unit(rng) * side, unit(rng) * side };
+                positions[i] = { center[0] + spread(rng), center[1] + spread(rng), center[2] + spread(rng) };
+            }
+            break;
+        }
+
+        case PILED: {
+            // Columns of 10 on a grid, each object slightly overlaps the one under it
+            uint32_t columns = std::max( 1u, (uint32_t)ceilf( sqrtf( count / 10.0f ) ) );
+            for( uint32_t i = 0; i < count; ++i ){
+                uint32_t column = i / 10, level = i % 10;
+                positions[i] = { (column % columns) * 2.5f, 1 + level * 1.9f, (column / columns) * 2.5f };
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+/*
+ * An even mix of spheres, boxes and capsules of around unit size
+ */
+static void build_scene( Distribution distribution, uint32_t count, uint32_t seed, BenchScene &scene ){
+    std::mt19937 rng( seed );
+    std::uniform_real_distribution<float> size( .5f, 1.0f );
+    std::vector<BenchPos> positions;
+    place( distribution, count, rng, positions );
+
+    scene.spheres.reserve( count );
+    scene.boxes.reserve( count );
+    scene.capsules.reserve( count );
+    scene.shapes.clear();
+    for( uint32_t i = 0; i < count; ++i ){
+        CollisionShape *shape;
+        switch( i % 3 ){
+            case 0:
+                scene.spheres.emplace_back();
+                scene.spheres.back().radius = size( rng );
+                shape = &scene.spheres.back();
+                break;
+            case 1:
+                scene.boxes.emplace_back();
+                glm_vec3_fill( scene.boxes.back().half_extents, size( rng ) );
+                shape = &scene.boxes.back();
+                break;
+            default:
+                scene.capsules.emplace_back();
+                scene.capsules.back().radius = size( rng ) * .5f;
+                scene.capsules.back().y_extension = .5f;
+                shape = &scene.capsules.back();
+                break;
+        }
+        for( unsigned int a = 0; a < 3; ++a )
+            shape->pos[a] = positions[i][a];
+        shape->updateAABB();
+        scene.shapes.push_back( shape );
+    }
+
+    scene.aabbs.resize( count );
+    scene.oids.resize( count );
+    for( uint32_t i = 0; i < count; ++i ){
+        scene.aabbs[i] = scene.shapes[i]->aabb;
+        scene.oids[i] = i;
+    }
+}
+
+// Overlapping shape pairs found by a tree of the scene, each pair once
+static void find_pairs( BenchScene &scene, std::vector<std::pair<ObjectID, ObjectID>> &pairs ){
+    DBVH tree;
+    tree.build( scene.aabbs.data(), scene.oids.data(), scene.aabbs.size() );
+    ObjectID candidates[MAX_PAIR_CANDIDATES];
+    unsigned int count;
+    pairs.clear();
+    for( ObjectID a = 0; a < scene.aabbs.size(); ++a ){
+        tree.get_intersecting( scene.aabbs[a], candidates, count, MAX_PAIR_CANDIDATES );
+        for( unsigned int i = 0; i < count; ++i )
+            if( candidates[i] > a )
+                pairs.push_back( {a, candidates[i]} );
+    }
+}
+
+/*
+ * Sorts the samples and prints the result, ops is the number of operations in one sample
+ */
+static void report( const BenchConfig &config, const char *name, Distribution distribution, uint32_t count, uint64_t ops, std::vector<double> &samples ){
+    if( samples.empty() )
+        return;
+    std::sort( samples.begin(), samples.end() );
+    double total = 0;
+    for( double s : samples )
+        total += s;
+    double mean = total / samples.size();
+    auto percentile = [&samples]( double p ){
+        size_t i = (size_t)ceil( p * samples.size() );
+        return samples[ std::min( samples.size() - 1, i > 0 ? i - 1 : 0 ) ];
+    };
+    double ns_per_op = ops ? mean * 1000 / ops : 0;
+
+    if( config.json ){
+        printf( "{\"benchmark\":\"%s\",\"distribution\":\"%s\",\"count\":%u,\"ops\":%llu,\"iterations\":%zu,"
+                "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,\"ns_per_op\":%.3f}\n",
+                name, distribution_names[distribution], count, (unsigned long long)ops, samples.size(),
+                mean, percentile( .5 ), percentile( .9 ), percentile( .99 ), samples.back(), ns_per_op );
+    }
+    else{
+        printf( "%-16s %-10s %7u %9llu %11.1f %11.1f %11.1f %11.1f %11.1f %9.1f\n",
+                name, distribution_names[distribution], count, (unsigned long long)ops,
+                mean, percentile( .5 ), percentile( .9 ), percentile( .99 ), samples.back(), ns_per_op );
+    }
+    fflush( stdout );
+}
+
+static inline bool selected( const BenchConfig &config, const char *name ){
+    return config.filter.empty() || strstr( name, config.filter.c_str() ) != nullptr;
+}
+
+static void bench_dbvh( const BenchConfig &config, Distribution distribution, BenchScene &scene ){
+    uint32_t count = scene.aabbs.size();
+    std::vector<NodeID> nids( count );
+    std::vector<double> samples;
+    BenchClock::time_point start;
+
+    if( selected( config, "dbvh_insert" ) ){
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            DBVH tree;
+            start = BenchClock::now();
+            for( uint32_t i = 0; i < count; ++i )
+                nids[i] = tree.insert( scene.aabbs[i], i );
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "dbvh_insert", distribution, count, count, samples );
+    }
+
+    if( selected( config, "dbvh_remove" ) ){
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            DBVH tree;
+            for( uint32_t i = 0; i < count; ++i )
+                nids[i] = tree.insert( scene.aabbs[i], i );
+            start = BenchClock::now();
+            for( uint32_t i = 0; i < count; ++i )
+                tree.remove( nids[i] );
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "dbvh_remove", distribution, count, count, samples );
+    }
+
+    if( selected( config, "dbvh_build" ) ){
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            DBVH tree;
+            start = BenchClock::now();
+            tree.build( scene.aabbs.data(), scene.oids.data(), count, nids.data() );
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "dbvh_build", distribution, count, count, samples );
+    }
+
+    // Every box is moved a little each iteration, most stay inside their enlarged box
+    if( selected( config, "dbvh_move" ) ){
+        DBVH tree;
+        std::vector<AABB> moved( scene.aabbs );
+        for( uint32_t i = 0; i < count; ++i ){
+            AABB fat = moved[i];
+            fat.expand( DBVH_FAT_MARGIN );
+            nids[i] = tree.insert( fat, i );
+        }
+        vec3 step = {.02f, 0, .01f};
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            start = BenchClock::now();
+            for( uint32_t i = 0; i < count; ++i ){
+                moved[i].translate( step );
+                tree.move( nids[i], moved[i], step );
+            }
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "dbvh_move", distribution, count, count, samples );
+    }
+
+    if( selected( config, "dbvh_query" ) ){
+        DBVH tree;
+        tree.build( scene.aabbs.data(), scene.oids.data(), count );
+        ObjectID candidates[MAX_PAIR_CANDIDATES];
+        unsigned int found;
+        uint64_t total = 0;
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            start = BenchClock::now();
+            for( uint32_t i = 0; i < count; ++i ){
+                tree.get_intersecting( scene.aabbs[i], candidates, found, MAX_PAIR_CANDIDATES );
+                total += found;
+            }
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "dbvh_query", distribution, count, count, samples );
+        if( total == 0 && !config.json )
+            puts( "  (no overlaps)" );
+    }
+}
+
+static void bench_narrowphase( const BenchConfig &config, Distribution distribution, BenchScene &scene ){
+    std::vector<std::pair<ObjectID, ObjectID>> pairs;
+    find_pairs( scene, pairs );
+    std::vector<double> samples;
+    BenchClock::time_point start;
+    vec3 resolve;
+
+    if( selected( config, "gjk" ) ){
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            start = BenchClock::now();
+            for( auto &[a, b] : pairs )
+                CollisionShape::gjk( *scene.shapes[a], *scene.shapes[b], resolve );
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "gjk", distribution, scene.shapes.size(), pairs.size(), samples );
+    }
+
+    // Same as the PhysicsSystem narrowphase on one thread, closed form tests and a cache per pair
+    if( selected( config, "narrowphase" ) ){
+        std::vector<GJKCache> caches( pairs.size() );
+        samples.clear();
+        for( uint32_t it = 0; it < config.iterations; ++it ){
+            start = BenchClock::now();
+            for( size_t i = 0; i < pairs.size(); ++i )
+                CollisionShape::collide( *scene.shapes[pairs[i].first], *scene.shapes[pairs[i].second], resolve, &caches[i] );
+            samples.push_back( elapsed_us( start ) );
+        }
+        report( config, "narrowphase", distribution, scene.shapes.size(), pairs.size(), samples );
+    }
+}
+
+/*
+ * Every shape is a dynamic object falling onto a static floor of boxes, each sample is one update
+ */
+static void bench_step( const BenchConfig &config, Distribution distribution, BenchScene &scene ){
+    if( !selected( config, "physics_step" ) )
+        return;
+
+    PhysicsSystem physics;
+    physics.init( config.workers );
+
+    // Floor tiles under the whole scene
+    AABB bounds = scene.aabbs[0];
+    for( AABB &b : scene.aabbs )
+        bounds = bounds | b;
+    int tiles_x = std::max( 1, (int)ceilf( (bounds.upper()[0] - bounds.lower()[0]) / 8 ) );
+    int tiles_z = std::max( 1, (int)ceilf( (bounds.upper()[2] - bounds.lower()[2]) / 8 ) );
+    std::vector<Box> floor( tiles_x * tiles_z );
+    std::vector<StaticObject> statics( floor.size() );
+    for( int z = 0; z < tiles_z; ++z ){
+        for( int x = 0; x < tiles_x; ++x ){
+            Box &tile = floor[z * tiles_x + x];
+            tile.half_extents[0] = tile.half_extents[2] = 4;
+            tile.half_extents[1] = .5f;
+            tile.pos[0] = bounds.lower()[0] + x * 8 + 4;
+            tile.pos[1] = bounds.lower()[1] - 1;
+            tile.pos[2] = bounds.lower()[2] + z * 8 + 4;
+            tile.updateAABB();
+            statics[z * tiles_x + x].shape = &tile;
+        }
+    }
+    physics.create_objects( statics.data(), statics.size() );
+
+    // Shapes are copied so the scene is unchanged for the next benchmark
+    BenchScene moving;
+    build_scene( distribution, scene.shapes.size(), config.seed, moving );
+    std::vector<ObjectID> oids;
+    DynamicObject d;
+    for( CollisionShape *shape : moving.shapes ){
+        d.shape = shape;
+        oids.push_back( physics.create_object( d ) );
+    }
+
+    std::vector<double> samples;
+    BenchClock::time_point start;
+    for( uint32_t it = 0; it < config.iterations; ++it ){
+        // Gravity on awake objects, settled piles go to sleep like they would in game
+        for( ObjectID oid : oids ){
+            DynamicObject *o = physics.get_dynamic_object( oid );
+            if( o && o->awake )
+                o->velocity[1] -= .02f;
+        }
+        start = BenchClock::now();
+        physics.update();
+        samples.push_back( elapsed_us( start ) );
+    }
+    report( config, "physics_step", distribution, moving.shapes.size(), moving.shapes.size(), samples );
+}
+
+/*
+ * Up to MAX_PLAYERS players walking and leaping on generated terrain, each sample is one player step
+ */
+static void bench_players( const BenchConfig &config, Distribution distribution, Terrain &terrain ){
+    if( !selected( config, "players" ) )
+        return;
+
+    std::unique_ptr<PlayerSet> set( new PlayerSet() );
+    uint32_t count = std::min<uint32_t>( config.count, MAX_PLAYERS );
+    set->reserve( count );
+
+    std::mt19937 rng( config.seed );
+    std::vector<BenchPos> positions;
+    place( distribution, count, rng, positions );
+    for( uint8_t i = 0; i < count; ++i ){
+        Player &p = set->at( i );
+        p.collision_shape.pos[0] = TERRAIN_DIM * TERRAIN_SCALE * .5f + positions[i][0];
+        p.collision_shape.pos[1] = 20 + positions[i][1];
+        p.collision_shape.pos[2] = TERRAIN_DIM * TERRAIN_SCALE * .5f + positions[i][2];
+    }
+
+    std::uniform_int_distribution<uint16_t> input( 0, Player::FORWARD | Player::BACKWARD | Player::RIGHT | Player::LEFT | Player::LEAP );
+    std::vector<double> samples;
+    BenchClock::time_point start;
+    for( uint32_t it = 0; it < config.iterations; ++it ){
+        for( uint8_t i = 0; i < count; ++i )
+            set->at( i ).input_flag = input( rng );
+        start = BenchClock::now();
+        set->update_motion();
+        set->update_collision();
+        set->update_terrain_collision( &terrain );
+        samples.push_back( elapsed_us( start ) );
+    }
+    report( config, "players", distribution, count, count, samples );
+}
+
+static bool parse_args( int argc, char **argv, BenchConfig &config ){
+    for( int i = 1; i < argc; ++i ){
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if( strcmp( arg, "--json" ) == 0 ){
+            config.json = true;
+            continue;
+        }
+        if( !value ){
+            printf( "ERROR: Missing value for %s\n", arg );
+            return false;
+        }
+        ++i;
+        if( strcmp( arg, "--count" ) == 0 )
+            config.count = std::max( 1, atoi( value ) );
+        else if( strcmp( arg, "--iterations" ) == 0 )
+            config.iterations = std::max( 1, atoi( value ) );
+        else if( strcmp( arg, "--seed" ) == 0 )
+            config.seed = atoi( value );
+        else if( strcmp( arg, "--workers" ) == 0 )
+            config.workers = std::max( 0, atoi( value ) );
+        else if( strcmp( arg, "--filter" ) == 0 )
+            config.filter = value;
+        else if( strcmp( arg, "--distribution" ) == 0 ){
+            config.distribution = -1;
+            for( int d = 0; d < DISTRIBUTION_COUNT; ++d )
+                if( strcmp( value, distribution_names[d] ) == 0 )
+                    config.distribution = d;
+            if( config.distribution < 0 && strcmp( value, "all" ) != 0 ){
+                printf( "ERROR: Unknown distribution %s\n", value );
+                return false;
+            }
+        }
+        else{
+            printf( "ERROR: Unknown argument %s\n", arg );
+            return false;
+        }
+    }
+    return true;
+}
+
+int main( int argc, char **argv ){
+    BenchConfig config;
+    if( !parse_args( argc, argv, config ) ){
+        puts( "Usage: physics_bench [--count N] [--iterations N] [--distribution uniform|clustered|piled|all] [--seed N] [--workers N] [--filter name] [--json]" );
+        return 1;
+    }
+
+    if( !config.json )
+        printf( "%-16s %-10s %7s %9s %11s %11s %11s %11s %11s %9s\n",
+                "benchmark", "scene", "count", "ops", "mean_us", "p50_us", "p90_us", "p99_us", "max_us", "ns/op" );
+
+    // The terrain is large, so it is kept off the stack
+    std::unique_ptr<Terrain> terrain( new Terrain() );
+    terrain->generate();
+
+    for( int d = 0; d < DISTRIBUTION_COUNT; ++d ){
+        if( config.distribution >= 0 && config.distribution != d )
+            continue;
+        Distribution distribution = (Distribution)d;
+        BenchScene scene;
+        build_scene( distribution, config.count, config.seed, scene );
+
+        bench_dbvh( config, distribution, scene );
+        bench_narrowphase( config, distribution, scene );
+        bench_step( config, distribution, scene );
+        bench_players( config, distribution, *terrain );
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "Client.h"
 #include <thread>
 #include <cstring>
+#include "Profiler.h"
 
 // Init the extern client
 Client *active_client;
@@ -121,9 +122,12 @@ void Client::run() {
             update_cap = 10;                              // The maximum amount of updates run per loop
 
 
+    Profiler::set_thread_name("Client");
+
     // Start client loop
     while( !glfwWindowShouldClose( window ) ) {
         start = std::chrono::steady_clock::now();
+        PROFILE_ZONE("Client::frame");
 
         // Update menus
         Menu::update();
@@ -145,11 +149,14 @@ void Client::run() {
                 Player *active_player = scene.player_set.get_active();
 
                 // Update the scene using the step count (prediction)
+                // Each step's input is recorded so it can be predicted again when a snapshot arrives
                 for( int i = 0; i < updates; ++i ) {
+                    if( active_player )
+                        scene.player_set.record_input();
                     scene.update( );
                     scene.player_set.update_armatures();
                     if( active_player ) {
-                        Packet::send_player_input(active_player, connection.peer_server);
+                        Packet::send_player_input(&scene.player_set, connection.peer_server);
                     }
                 }
 
@@ -299,6 +306,22 @@ void Client::keyCallback( GLFWwindow *window, int key, int scancode, int action,
     if(action == GLFW_PRESS && key == GLFW_KEY_ESCAPE && mods & GLFW_MOD_ALT)
         glfwSetWindowShouldClose(window,GLFW_TRUE);
 
+    // Start profiling, the trace is written when stopped
+    if(action == GLFW_PRESS && key == GLFW_KEY_P && mods & GLFW_MOD_ALT){
+        if(!Profiler::is_enabled()){
+            Profiler::enabled = true;
+            puts("Profiler: Started.");
+        }
+        else{
+            Profiler::enabled = false;
+            if(Profiler::export_trace(PROFILER_TRACE_FILE))
+                printf("Profiler: Trace written to %s\n", PROFILER_TRACE_FILE);
+            else
+                printf("Profiler: Could not write %s\n", PROFILER_TRACE_FILE);
+        }
+        fflush(stdout);
+    }
+
     // Player Controls
     Player *p = client->scene.player_set.get_active();
 
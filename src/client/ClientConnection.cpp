@@ -1,5 +1,6 @@
 #include "ClientConnection.h"
 #include "Client.h"
+#include "Profiler.h"
 
 ClientConnection::~ClientConnection(){
 }
@@ -38,7 +39,7 @@ void ClientConnection::connect(std::string ip, int port){
             enet_peer_reset( peer_server );
         enet_address_set_host( &server_address, ip.c_str() );
         server_address.port = port;
-        peer_server = enet_host_connect( host_client, &server_address, 2, 0 );
+        peer_server = enet_host_connect( host_client, &server_address, CONNECTION_CHANNELS, 0 );
         status = ClientConnection::DISCONNECTED;
 
         Menu::activate(&active_client->menu_message);
@@ -116,6 +117,7 @@ void ClientConnection::disconnect(bool force, std::string reason){
 }
 
 void ClientConnection::update(){
+    PROFILE_ZONE("ClientConnection::update");
 
     // Perform an attempt if the status is pending
     if( status == ClientConnection::PENDING ) {
@@ -156,21 +158,23 @@ void ClientConnection::update(){
 }
 
 void ClientConnection::interpret_packet( ENetPacket *packet ) {
-    uint8_t type = ( uint8_t )packet->data[0];
+    packet_type type = Packet::get_type( packet );
 
     Player *p = owner->scene.player_set.get_active();
 
     switch( type ) {
         case Packet::PACKET_KICK: {
             std::string reason;
-            Packet::receive_kick( reason, packet );
+            if( !Packet::receive_kick( reason, packet ) )
+                reason = "Malformed kick";
             reason = "Kicked: " + reason;
             disconnect( true, reason );
             break;
         }
 
         case Packet::PACKET_PLAYER_STATUS_SYNCH: {
-            Packet::receive_player_status_synch(&owner->scene.player_set, packet);
+            if( !Packet::receive_player_status_synch(&owner->scene.player_set, packet) )
+                break;
             // If the username was found
             if(owner->scene.player_set.set_active(username) != MAX_PLAYERS){
                 // Only when switching from a non-playing state
@@ -183,7 +187,12 @@ void ClientConnection::interpret_packet( ENetPacket *packet ) {
         }
 
         case Packet::PACKET_PLAYER_SYNCH: {
-            Packet::receive_player_synch( &owner->scene.player_set, packet );
+            uint32_t id = Packet::receive_player_synch( &owner->scene.player_set, packet );
+            // Acknowledge so the server encodes the next snapshots against this one
+            if(id != 0){
+                Packet::send_snapshot_ack(id, peer_server);
+                owner->scene.reconcile();
+            }
             break;
         }
 
@@ -23,14 +23,31 @@
 // View
 #define VIEW_NEAR .01f
 #define VIEW_FAR 80.0f
+#define CAMERA_BOOM_MARGIN .05f     // Fraction of the camera boom kept in front of a hit
 
 // Connection
 #define CONNECTION_DEFAULT_PORT 53687
+#define PROTOCOL_VERSION 2              // Sent in every packet, fields added to a packet note the version that added them
+#define PROTOCOL_MIN_VERSION 1          // Packets from older senders are dropped
+#define CONNECTION_CHANNELS 2           // Reliable channel and sequenced state channel, see Packet::Delivery
 
 // Server
 #define MAX_PLAYERS 16
 #define MAX_PLAYER_SAVES 64
 #define STEPS_PER_SECOND 20
+#define SNAPSHOT_HISTORY 32             // Snapshots kept for delta encoding, clients that fall further behind get a full snapshot
+#define SNAPSHOT_POSITION_MARGIN 16.0f  // Space around the terrain covered by quantized x and z positions
+#define SNAPSHOT_HEIGHT_MIN -16.0f      // Range of quantized heights
+#define SNAPSHOT_HEIGHT_MAX 112.0f
+#define SNAPSHOT_VELOCITY_SCALE 1024.0f // Steps per unit of quantized velocity
+#define INPUT_HISTORY 64                // Steps of input kept, the client predicts the unacknowledged ones again after each snapshot
+#define INPUT_REDUNDANCY 4              // Recent inputs repeated in each input packet, so one lost packet does not lose an input
+#define PHYSICS_DETERMINISTIC false // Snap simulated positions and velocities to the fixed-point grid every step, reduces drift between builds
+
+// Profiler
+#define PROFILER_ZONES true             // Compile the PROFILE_ZONE scopes, they only record while enabled
+#define PROFILER_BUFFER_EVENTS 16384    // Zones kept per thread, older zones are overwritten
+#define PROFILER_TRACE_FILE "../trace.json"
 
 // Player
 
@@ -40,6 +57,7 @@
 #define PLANT_MAX_INSTANCES 500     // Can be up to 511 (2^9)-2
 #define PLANT_SPECIES_MASK 0xfd
 #define PLANT_INSTANCE_MASK 0x1ff
+#define PLANT_INSTANCE_BITS 9       // A plant id is the species shifted above the instance
 
 // File Directories
 #define DIR_CONFIGS   "../config/"
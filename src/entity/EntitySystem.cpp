@@ -1,5 +1,6 @@
 #include "EntitySystem.h"
 #include "EntityRegistry.h"
+#include "Profiler.h"
 
 void EntitySystem::add_entity_type( EntityType *e){
     if(type_count >= MAX_TYPES){
@@ -35,6 +36,7 @@ void EntitySystem::close_entity_assets(){
 
 
 void EntitySystem::update(){
+    PROFILE_ZONE("EntitySystem::update");
 
     physics.update();
 
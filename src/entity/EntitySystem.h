@@ -26,6 +26,11 @@ public:
     void close();
     void init_entity_assets();
     void close_entity_assets();
+
+    // Closest entity hit by the ray origin + dir*t, max_t is set to the distance of the hit, returns null_entity on a miss
+    inline EntityID raycast(const vec3 origin, const vec3 dir, float &max_t){
+        return physics.raycast(origin, dir, max_t);
+    }
 };
 
 #endif // ENTITYSYSTEM_H
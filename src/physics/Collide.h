@@ -0,0 +1,449 @@
+#ifndef COLLIDE_H
+#define COLLIDE_H
+
+#include "GJK.h"
+
+#define SWEEP_BISECTIONS 8      // Refinement steps for the time of impact of a sweep, shared with Terrain::sweep
+#define SWEEP_SLOP 0.01f        // Penetration allowed past the starting contact before a sweep stops
+
+/*
+ * Collision with the cheapest available method, resolve follows the GJK convention:
+ * it points from shape_a into shape_b with the length of the penetration, shape_a is separated by moving -resolve.
+ * Sphere, capsule and sphere-box pairs are solved in closed form, every other pair falls back to GJK/EPA.
+ * The optional cache is only used by GJK.
+ */
+template<typename A, typename B>
+inline bool collide( A &shape_a, B &shape_b, vec3 resolve = nullptr, GJKCache *cache = nullptr ){
+    if(cache)
+        return gjk(shape_a, shape_b, *cache, resolve);
+    return gjk(shape_a, shape_b, resolve);
+}
+
+// Closest point to p on the segment from a to b
+inline void closest_point_segment( const vec3 p, const vec3 a, const vec3 b, vec3 dest ){
+    vec3 ab, ap;
+    glm_vec3_sub( (float*)b, (float*)a, ab );
+    glm_vec3_sub( (float*)p, (float*)a, ap );
+    float len2 = glm_vec3_norm2( ab );
+    float t = len2 > 0 ? glm_clamp( glm_vec3_dot( ap, ab ) / len2, 0, 1 ) : 0;
+    glm_vec3_copy( (float*)a, dest );
+    glm_vec3_muladds( ab, t, dest );
+}
+
+/*
+ * Closest point to p on the triangle abc, returns true if it is inside the face and not on an edge or vertex
+ * From Real-Time Collision Detection (Ericson) 5.1.5
+ */
+inline bool closest_point_triangle( const vec3 p, const vec3 a, const vec3 b, const vec3 c, vec3 dest ){
+    vec3 ab, ac, ap, bp, cp;
+    glm_vec3_sub( (float*)b, (float*)a, ab );
+    glm_vec3_sub( (float*)c, (float*)a, ac );
+    glm_vec3_sub( (float*)p, (float*)a, ap );
+
+    // Vertex region a
+    float d1 = glm_vec3_dot( ab, ap ), d2 = glm_vec3_dot( ac, ap );
+    if( d1 <= 0 && d2 <= 0 ){
+        glm_vec3_copy( (float*)a, dest );
+        return false;
+    }
+
+    // Vertex region b
+    glm_vec3_sub( (float*)p, (float*)b, bp );
+    float d3 = glm_vec3_dot( ab, bp ), d4 = glm_vec3_dot( ac, bp );
+    if( d3 >= 0 && d4 <= d3 ){
+        glm_vec3_copy( (float*)b, dest );
+        return false;
+    }
+
+    // Edge region ab
+    float vc = d1*d4 - d3*d2;
+    if( vc <= 0 && d1 >= 0 && d3 <= 0 ){
+        glm_vec3_copy( (float*)a, dest );
+        glm_vec3_muladds( ab, d1 / (d1 - d3), dest );
+        return false;
+    }
+
+    // Vertex region c
+    glm_vec3_sub( (float*)p, (float*)c, cp );
+    float d5 = glm_vec3_dot( ab, cp ), d6 = glm_vec3_dot( ac, cp );
+    if( d6 >= 0 && d5 <= d6 ){
+        glm_vec3_copy( (float*)c, dest );
+        return false;
+    }
+
+    // Edge region ac
+    float vb = d5*d2 - d1*d6;
+    if( vb <= 0 && d2 >= 0 && d6 <= 0 ){
+        glm_vec3_copy( (float*)a, dest );
+        glm_vec3_muladds( ac, d2 / (d2 - d6), dest );
+        return false;
+    }
+
+    // Edge region bc
+    float va = d3*d6 - d5*d4;
+    if( va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0 ){
+        vec3 bc;
+        glm_vec3_sub( (float*)c, (float*)b, bc );
+        glm_vec3_copy( (float*)b, dest );
+        glm_vec3_muladds( bc, (d4 - d3) / ((d4 - d3) + (d5 - d6)), dest );
+        return false;
+    }
+
+    // Face region
+    float denom = 1 / (va + vb + vc);
+    glm_vec3_copy( (float*)a, dest );
+    glm_vec3_muladds( ab, vb * denom, dest );
+    glm_vec3_muladds( ac, vc * denom, dest );
+    return true;
+}
+
+/*
+ * Closest points between the segments p1-q1 and p2-q2
+ * From Real-Time Collision Detection (Ericson) 5.1.9
+ */
+inline void closest_points_segments( const vec3 p1, const vec3 q1, const vec3 p2, const vec3 q2, vec3 c1, vec3 c2 ){
+    vec3 d1, d2, r;
+    glm_vec3_sub( (float*)q1, (float*)p1, d1 );
+    glm_vec3_sub( (float*)q2, (float*)p2, d2 );
+    glm_vec3_sub( (float*)p1, (float*)p2, r );
+    float a = glm_vec3_dot( d1, d1 ), e = glm_vec3_dot( d2, d2 ), f = glm_vec3_dot( d2, r );
+    float s = 0, t = 0;
+
+    if( a <= GLM_FLT_EPSILON && e <= GLM_FLT_EPSILON ){
+        // Both segments are points
+    }
+    else if( a <= GLM_FLT_EPSILON ){
+        t = glm_clamp( f / e, 0, 1 );
+    }
+    else{
+        float c = glm_vec3_dot( d1, r );
+        if( e <= GLM_FLT_EPSILON ){
+            s = glm_clamp( -c / a, 0, 1 );
+        }
+        else{
+            // Parallel segments use s = 0
+            float b = glm_vec3_dot( d1, d2 ), denom = a*e - b*b;
+            if( denom != 0 )
+                s = glm_clamp( (b*f - c*e) / denom, 0, 1 );
+            t = (b*s + f) / e;
+            if( t < 0 ){
+                t = 0;
+                s = glm_clamp( -c / a, 0, 1 );
+            }
+            else if( t > 1 ){
+                t = 1;
+                s = glm_clamp( (b - c) / a, 0, 1 );
+            }
+        }
+    }
+    glm_vec3_copy( (float*)p1, c1 );
+    glm_vec3_muladds( d1, s, c1 );
+    glm_vec3_copy( (float*)p2, c2 );
+    glm_vec3_muladds( d2, t, c2 );
+}
+
+// Two spheres given by center and radius, the base of every rounded shape pair
+inline bool collide_spheres( const vec3 center_a, float radius_a, const vec3 center_b, float radius_b, vec3 resolve ){
+    vec3 d;
+    glm_vec3_sub( (float*)center_b, (float*)center_a, d );
+    float r = radius_a + radius_b;
+    float dist2 = glm_vec3_norm2( d );
+    if( dist2 > r*r )
+        return false;
+    if( resolve ){
+        // Coincident centers separate upwards
+        float dist = sqrtf( dist2 );
+        if( dist > GLM_FLT_EPSILON )
+            glm_vec3_scale( d, (r - dist) / dist, resolve );
+        else
+        {
+            resolve[0] = resolve[2] = 0;
+            resolve[1] = r;
+        }
+    }
+    return true;
+}
+
+// End points of the capsule segment
+inline void capsule_segment( Capsule &c, vec3 p, vec3 q ){
+    vec3 axis = {0, c.y_extension, 0};
+    glm_quat_rotatev( c.rot, axis, axis );
+    glm_vec3_add( c.pos, axis, p );
+    glm_vec3_sub( c.pos, axis, q );
+}
+
+inline bool collide( Sphere &shape_a, Sphere &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    return collide_spheres( shape_a.pos, shape_a.radius, shape_b.pos, shape_b.radius, resolve );
+}
+
+inline bool collide( Sphere &shape_a, Capsule &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    vec3 p, q, c;
+    capsule_segment( shape_b, p, q );
+    closest_point_segment( shape_a.pos, p, q, c );
+    return collide_spheres( shape_a.pos, shape_a.radius, c, shape_b.radius, resolve );
+}
+
+inline bool collide( Capsule &shape_a, Sphere &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    vec3 p, q, c;
+    capsule_segment( shape_a, p, q );
+    closest_point_segment( shape_b.pos, p, q, c );
+    return collide_spheres( c, shape_a.radius, shape_b.pos, shape_b.radius, resolve );
+}
+
+inline bool collide( Capsule &shape_a, Capsule &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    vec3 pa, qa, pb, qb, ca, cb;
+    capsule_segment( shape_a, pa, qa );
+    capsule_segment( shape_b, pb, qb );
+    closest_points_segments( pa, qa, pb, qb, ca, cb );
+    return collide_spheres( ca, shape_a.radius, cb, shape_b.radius, resolve );
+}
+
+inline bool collide( Sphere &shape_a, Box &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    // Sphere center in the box axes
+    vec3 axes[3] = {{1,0,0},{0,1,0},{0,0,1}}, d, local, closest;
+    glm_vec3_sub( shape_a.pos, shape_b.pos, d );
+    for(unsigned int i = 0; i < 3; ++i){
+        glm_quat_rotatev( shape_b.rot, axes[i], axes[i] );
+        local[i] = glm_vec3_dot( d, axes[i] );
+        closest[i] = glm_clamp( local[i], -shape_b.half_extents[i], shape_b.half_extents[i] );
+    }
+
+    vec3 offset;
+    glm_vec3_sub( local, closest, offset );
+    float dist2 = glm_vec3_norm2( offset );
+    if( dist2 > shape_a.radius*shape_a.radius )
+        return false;
+    if( !resolve )
+        return true;
+
+    // Center outside the box, push away from the closest point
+    if( dist2 > GLM_FLT_EPSILON ){
+        float dist = sqrtf( dist2 );
+        float s = -(shape_a.radius - dist) / dist;
+        glm_vec3_zero( resolve );
+        for(unsigned int i = 0; i < 3; ++i)
+            glm_vec3_muladds( axes[i], offset[i] * s, resolve );
+        return true;
+    }
+
+    // Center inside the box, push out through the closest face
+    unsigned int face = 0;
+    float depth = shape_b.half_extents[0] - fabsf( local[0] ), face_depth;
+    for(unsigned int i = 1; i < 3; ++i){
+        face_depth = shape_b.half_extents[i] - fabsf( local[i] );
+        if( face_depth < depth ){
+            depth = face_depth;
+            face = i;
+        }
+    }
+    glm_vec3_scale( axes[face], local[face] < 0 ? depth + shape_a.radius : -(depth + shape_a.radius), resolve );
+    return true;
+}
+
+inline bool collide( Box &shape_a, Sphere &shape_b, vec3 resolve = nullptr, GJKCache * = nullptr ){
+    if( !collide( shape_b, shape_a, resolve ) )
+        return false;
+    if( resolve )
+        glm_vec3_negate( resolve );
+    return true;
+}
+
+/*
+ * Move shape_a along motion against a still shape_b and find the first contact, t is the fraction of motion at the contact.
+ * The motion is divided into steps of a quarter of shape_a's smallest dimension, the first overlapping step is bisected.
+ * Pairs that start in contact only stop when the contact gets deeper. The AABB of shape_a must be up to date, it is not moved.
+ */
+template<typename A, typename B>
+bool sweep( A &shape_a, B &shape_b, const vec3 motion, float &t ){
+    vec3 start, r;
+    glm_vec3_copy( shape_a.pos, start );
+    t = 1;
+
+    float start_depth = collide( shape_a, shape_b, r ) ? glm_vec3_norm( r ) : 0;
+    start_depth += SWEEP_SLOP;
+
+    float extent = INFINITY;
+    for( unsigned int i = 0; i < 3; ++i )
+        extent = std::min( extent, shape_a.aabb.upper()[i] - shape_a.aabb.lower()[i] );
+    float length = glm_vec3_norm( (float*)motion );
+    unsigned int steps = std::max( 1.0f, ceilf( length / std::max( extent * .25f, 0.001f ) ) );
+
+    bool hit = false;
+    float prev = 0, next;
+    for( unsigned int i = 1; i <= steps && !hit; ++i ) {
+        next = (float)i / steps;
+        glm_vec3_copy( start, shape_a.pos );
+        glm_vec3_muladds( (float*)motion, next, shape_a.pos );
+        if( collide( shape_a, shape_b, r ) && glm_vec3_norm( r ) > start_depth ) {
+            // Bisect between the last free position and the contact, the contact side is kept
+            hit = true;
+            for( unsigned int b = 0; b < SWEEP_BISECTIONS; ++b ) {
+                float mid = (prev + next) * .5f;
+                glm_vec3_copy( start, shape_a.pos );
+                glm_vec3_muladds( (float*)motion, mid, shape_a.pos );
+                if( collide( shape_a, shape_b, r ) && glm_vec3_norm( r ) > start_depth )
+                    next = mid;
+                else
+                    prev = mid;
+            }
+            t = next;
+        }
+        prev = next;
+    }
+
+    glm_vec3_copy( start, shape_a.pos );
+    return hit;
+}
+
+/*
+ * Ray casts against a single shape, the ray is origin + dir*t with t in [0, max_t].
+ * On a hit t is the entry distance (0 if the origin is inside the shape).
+ * Spheres, capsules, boxes and triangles are exact, other shapes use their AABB.
+ */
+template<typename S>
+inline bool raycast( S &shape, const vec3 origin, const vec3 dir, float max_t, float &t ){
+    vec3 inv_dir = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    return shape.aabb.ray_intersect( origin, inv_dir, max_t, t );
+}
+
+// First t where the ray is within radius of center
+inline bool ray_sphere( const vec3 origin, const vec3 dir, const vec3 center, float radius, float max_t, float &t ){
+    vec3 m;
+    glm_vec3_sub( (float*)origin, (float*)center, m );
+    float a = glm_vec3_norm2( (float*)dir );
+    float b = glm_vec3_dot( m, (float*)dir );
+    float c = glm_vec3_norm2( m ) - radius*radius;
+
+    // Starting inside
+    if( c <= 0 ){
+        t = 0;
+        return true;
+    }
+    // Outside and moving away, or a zero length ray
+    if( b >= 0 || a <= 0 )
+        return false;
+    float disc = b*b - a*c;
+    if( disc < 0 )
+        return false;
+    t = (-b - sqrtf( disc )) / a;
+    return t <= max_t;
+}
+
+inline bool raycast( Sphere &shape, const vec3 origin, const vec3 dir, float max_t, float &t ){
+    return ray_sphere( origin, dir, shape.pos, shape.radius, max_t, t );
+}
+
+/*
+ * The capsule is the union of the cylinder around its segment and the two end spheres,
+ * the first hit is the nearest of the cylinder side (within the segment) and both spheres.
+ */
+inline bool raycast( Capsule &shape, const vec3 origin, const vec3 dir, float max_t, float &t ){
+    vec3 p, q, axis, m;
+    capsule_segment( shape, p, q );
+    glm_vec3_sub( q, p, axis );
+    glm_vec3_sub( (float*)origin, p, m );
+    float len2 = glm_vec3_norm2( axis );
+
+    bool hit = false;
+    float t_end;
+    if( ray_sphere( origin, dir, p, shape.radius, max_t, t_end ) ){
+        max_t = t = t_end;
+        hit = true;
+    }
+    if( ray_sphere( origin, dir, q, shape.radius, max_t, t_end ) ){
+        max_t = t = t_end;
+        hit = true;
+    }
+    if( len2 <= 0 )
+        return hit;
+
+    // Remove the axis components and intersect the infinite cylinder
+    float md = glm_vec3_dot( m, axis ) / len2, dd = glm_vec3_dot( (float*)dir, axis ) / len2;
+    vec3 m_perp, d_perp;
+    glm_vec3_copy( m, m_perp );
+    glm_vec3_muladds( axis, -md, m_perp );
+    glm_vec3_copy( (float*)dir, d_perp );
+    glm_vec3_muladds( axis, -dd, d_perp );
+
+    float a = glm_vec3_norm2( d_perp );
+    float b = glm_vec3_dot( m_perp, d_perp );
+    float c = glm_vec3_norm2( m_perp ) - shape.radius*shape.radius;
+    float t_side, s;
+    if( c <= 0 )
+        t_side = 0;
+    else if( b >= 0 || a <= 0 || b*b - a*c < 0 )
+        return hit;
+    else
+        t_side = (-b - sqrtf( b*b - a*c )) / a;
+
+    // The side only counts between the end points
+    s = md + dd*t_side;
+    if( t_side <= max_t && s >= 0 && s <= 1 ){
+        t = t_side;
+        hit = true;
+    }
+    return hit;
+}
+
+inline bool raycast( Box &shape, const vec3 origin, const vec3 dir, float max_t, float &t ){
+    // Slab test in the box axes
+    vec3 axes[3] = {{1,0,0},{0,1,0},{0,0,1}}, d;
+    float t_min = 0, t_max = max_t, o, v, t1, t2;
+    glm_vec3_sub( (float*)origin, shape.pos, d );
+    for(unsigned int i = 0; i < 3; ++i){
+        glm_quat_rotatev( shape.rot, axes[i], axes[i] );
+        o = glm_vec3_dot( d, axes[i] );
+        v = glm_vec3_dot( (float*)dir, axes[i] );
+        if( fabsf( v ) < GLM_FLT_EPSILON ){
+            if( fabsf( o ) > shape.half_extents[i] )
+                return false;
+            continue;
+        }
+        t1 = (-shape.half_extents[i] - o) / v;
+        t2 = (shape.half_extents[i] - o) / v;
+        if( t1 > t2 )
+            std::swap( t1, t2 );
+        t_min = fmaxf( t_min, t1 );
+        t_max = fminf( t_max, t2 );
+        if( t_min > t_max )
+            return false;
+    }
+    t = t_min;
+    return true;
+}
+
+/*
+ * Two sided ray and triangle test (Moller-Trumbore)
+ */
+inline bool ray_triangle( const vec3 origin, const vec3 dir, const vec3 a, const vec3 b, const vec3 c, float max_t, float &t ){
+    vec3 ab, ac, p, s, q;
+    glm_vec3_sub( (float*)b, (float*)a, ab );
+    glm_vec3_sub( (float*)c, (float*)a, ac );
+    glm_vec3_cross( (float*)dir, ac, p );
+    float det = glm_vec3_dot( ab, p );
+    if( fabsf( det ) < GLM_FLT_EPSILON )
+        return false;
+    float inv_det = 1.0f / det;
+
+    glm_vec3_sub( (float*)origin, (float*)a, s );
+    float u = glm_vec3_dot( s, p ) * inv_det;
+    if( u < 0 || u > 1 )
+        return false;
+    glm_vec3_cross( s, ab, q );
+    float v = glm_vec3_dot( (float*)dir, q ) * inv_det;
+    if( v < 0 || u + v > 1 )
+        return false;
+    float t_hit = glm_vec3_dot( ac, q ) * inv_det;
+    if( t_hit < 0 || t_hit > max_t )
+        return false;
+    t = t_hit;
+    return true;
+}
+
+inline bool raycast( Triangle &shape, const vec3 origin, const vec3 dir, float max_t, float &t ){
+    vec3 local;
+    glm_vec3_sub( (float*)origin, shape.pos, local );
+    return ray_triangle( local, dir, shape.points[0], shape.points[1], shape.points[2], max_t, t );
+}
+
+#endif // COLLIDE_H
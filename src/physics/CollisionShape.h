@@ -4,7 +4,20 @@
 #include "../graphics/DebugDraw.h"
 #include "DBVH.h"
 
+// Tag of the concrete shape, used to dispatch to non-virtual collision functions
+enum ShapeType : uint8_t {
+    SHAPE_NONE,
+    SHAPE_SPHERE,
+    SHAPE_BOX,
+    SHAPE_CYLINDER,
+    SHAPE_CAPSULE,
+    SHAPE_TRIANGLE
+};
+
+struct GJKCache;
+
 struct CollisionShape {
+    ShapeType type = SHAPE_NONE;
     vec3 pos = GLM_VEC3_ZERO_INIT;
     versor rot = GLM_QUAT_IDENTITY_INIT;
     versor inv_rot = GLM_QUAT_IDENTITY_INIT;
@@ -19,11 +32,23 @@ struct CollisionShape {
     };
 
 
+    // Dispatches on type, see GJK.h for typed versions
     static bool gjk( CollisionShape &shape_a, CollisionShape &shape_b, vec3 resolve = nullptr);
+
+    // Same as gjk, but uses closed form tests where available, see Collide.h
+    // cache is an optional GJKCache kept by the caller for this pair
+    static bool collide( CollisionShape &shape_a, CollisionShape &shape_b, vec3 resolve = nullptr, GJKCache *cache = nullptr);
+
+    // Move shape_a along motion against shape_b, t is the fraction of motion at the first contact, see Collide.h
+    static bool sweep( CollisionShape &shape_a, CollisionShape &shape_b, const vec3 motion, float &t );
+
+    // Ray origin + dir*t against the shape for t in [0, max_t], t is set to the entry distance on a hit
+    static bool raycast( CollisionShape &shape, const vec3 origin, const vec3 dir, float max_t, float &t );
 };
 
 struct Sphere : CollisionShape {
     float radius = 1;
+    Sphere(){ type = SHAPE_SPHERE; }
     void updateAABB() override{
         vec3 a, b, r = {radius,radius,radius};
         // Add and subtract the radius from the center position
@@ -48,6 +73,7 @@ struct Sphere : CollisionShape {
 
 struct Box : CollisionShape {
     vec3 half_extents = GLM_VEC3_ONE_INIT;
+    Box(){ type = SHAPE_BOX; }
 
     void updateAABB() override{
         // Get half_extents
@@ -91,6 +117,7 @@ struct Box : CollisionShape {
 
 struct Cylinder : CollisionShape {
     float radius = 1, y_extension = 1;
+    Cylinder(){ type = SHAPE_CYLINDER; }
 
     void getSupportVector( const vec3 direction, vec3 &dest ) override {
         vec3 dir = {direction[0], direction[1], direction[2]};
@@ -142,6 +169,7 @@ struct Cylinder : CollisionShape {
 
 struct Capsule : CollisionShape {
     float radius = 1, y_extension = 1;
+    Capsule(){ type = SHAPE_CAPSULE; }
 
     void getSupportVector( const vec3 direction, vec3 &dest ) override {
         vec3 dir = {direction[0],direction[1],direction[2]};
@@ -167,12 +195,15 @@ struct Capsule : CollisionShape {
     };
     void updateAABB() override{
 
-        // Get the y extent and add the radius to it
-        vec3 a = {0, y_extension+radius, 0}, b;
-
         // Rotate the y extent
+        vec3 a = {0, y_extension, 0}, b;
         glm_quat_rotatev(rot, a, a);
 
+        // Add the radius on every axis to the absolute extent
+        a[0] = abs(a[0]) + radius;
+        a[1] = abs(a[1]) + radius;
+        a[2] = abs(a[2]) + radius;
+
         // Inverse to b, the other end of the box
         glm_vec3_inv_to(a,b);
 
@@ -186,6 +217,7 @@ struct Capsule : CollisionShape {
 
 struct Triangle : CollisionShape {
     vec3 points[3];
+    Triangle(){ type = SHAPE_TRIANGLE; }
 
     void getSupportVector( const vec3 direction, vec3 &dest ) override {
         vec3 dir = {direction[0],direction[1],direction[2]};
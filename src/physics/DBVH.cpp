@@ -1,5 +1,7 @@
 #include "physics/DBVH.h"
 #include <iostream>
+#include <atomic>
+#include <thread>
 #include "DebugDraw.h"
 
 
@@ -21,14 +23,23 @@ void AABB::set( vec3 a, vec3 b ) {
     bounds[1][2] = glm_max( a[2], b[2] );
 }
 
-bool AABB::intersects( AABB &a){
-    return glm_aabb_aabb(bounds, a.bounds);
+bool AABB::intersects( const AABB &a) const{
+    return glm_aabb_aabb((vec3*)bounds, (vec3*)a.bounds);
 }
 
 float AABB::volume() {
     return ( bounds[1][0] - bounds[0][0] ) * ( bounds[1][1] - bounds[0][1] ) * ( bounds[1][2] - bounds[0][2] );
 }
 
+float AABB::surface_area() {
+    float x = bounds[1][0] - bounds[0][0], y = bounds[1][1] - bounds[0][1], z = bounds[1][2] - bounds[0][2];
+    return 2 * ( x * y + y * z + z * x );
+}
+
+void AABB::center( vec3 dest ) {
+    glm_aabb_center( bounds, dest );
+}
+
 AABB AABB::operator|( AABB &a ) {
     AABB r;
     glm_aabb_merge(bounds, a.bounds, r.bounds);
@@ -36,13 +47,27 @@ AABB AABB::operator|( AABB &a ) {
 }
 
 void AABB::expand(float f){
-    glm_vec3_subs(bounds[0],f,bounds[1]);
-    glm_vec3_adds(bounds[1],f,bounds[0]);
+    glm_vec3_subs(bounds[0],f,bounds[0]);
+    glm_vec3_adds(bounds[1],f,bounds[1]);
 }
 
 void AABB::expand(vec3 f){
-    glm_vec3_sub(bounds[0],f,bounds[1]);
-    glm_vec3_add(bounds[1],f,bounds[0]);
+    glm_vec3_sub(bounds[0],f,bounds[0]);
+    glm_vec3_add(bounds[1],f,bounds[1]);
+}
+
+void AABB::extend(vec3 d){
+    for(uint8_t i = 0; i < 3; ++i){
+        if(d[i] < 0)
+            bounds[0][i] += d[i];
+        else
+            bounds[1][i] += d[i];
+    }
+}
+
+bool AABB::contains( AABB &a ){
+    return bounds[0][0] <= a.bounds[0][0] && bounds[0][1] <= a.bounds[0][1] && bounds[0][2] <= a.bounds[0][2]
+        && bounds[1][0] >= a.bounds[1][0] && bounds[1][1] >= a.bounds[1][1] && bounds[1][2] >= a.bounds[1][2];
 }
 
 void AABB::translate(vec3 pos){
@@ -70,8 +95,8 @@ bool AABB::in_frustum(vec4* frustum_planes, vec3 pos){
     return glm_aabb_frustum(a,frustum_planes);
 }
 
-bool AABB::in_frustum(vec4* frustum_planes){
-    return glm_aabb_frustum(bounds,frustum_planes);
+bool AABB::in_frustum(vec4* frustum_planes) const{
+    return glm_aabb_frustum((vec3*)bounds,frustum_planes);
 }
 
 float AABB::dist_to_center(vec3 pos){
@@ -80,14 +105,245 @@ float AABB::dist_to_center(vec3 pos){
     return glm_vec3_distance(p,pos);
 }
 
+float AABB::dist_to( const vec3 pos ) const{
+    vec3 d;
+    for(unsigned int i = 0; i < 3; ++i)
+        d[i] = fmaxf( fmaxf( bounds[0][i] - pos[i], pos[i] - bounds[1][i] ), 0 );
+    return glm_vec3_norm( d );
+}
+
+bool AABB::ray_intersect( const vec3 origin, const vec3 inv_dir, float max_t, float &t, const float *extent ) const{
+    float t_min = 0, t_max = max_t, t1, t2, lo, hi;
+    for(unsigned int i = 0; i < 3; ++i){
+        lo = bounds[0][i];
+        hi = bounds[1][i];
+        if(extent){
+            lo -= extent[i];
+            hi += extent[i];
+        }
+        t1 = (lo - origin[i]) * inv_dir[i];
+        t2 = (hi - origin[i]) * inv_dir[i];
+        if(t1 > t2)
+            std::swap(t1, t2);
+
+        // Written so a NaN (origin on a slab with a zero direction) leaves the range unchanged
+        if(t1 > t_min)
+            t_min = t1;
+        if(t2 < t_max)
+            t_max = t2;
+        if(t_min > t_max)
+            return false;
+    }
+    t = t_min;
+    return true;
+}
+
 
 DBVH::DBVH() {
     nodes.push_back(Node());
     leaf_count = 0;
 }
 
-// Create a static node queue, it is cleared every use for insertion
-static NodeQueue node_queue;
+/*
+ * Bulk build using a binned surface area heuristic.
+ * Each range is split along the axis with the largest spread of centers.
+ * Centers are placed into bins, the split between bins with the lowest cost SA(left)*N(left) + SA(right)*N(right) is used.
+ * If all centers fall in one bin the range is split in half by count.
+ */
+static constexpr uint32_t SAH_BIN_COUNT = 16;
+
+void DBVH::build( AABB *aabbs, ObjectID *oids, uint32_t count, NodeID *return_nodes ) {
+    nodes.clear();
+    root_index = 0;
+    free_list = null_node;
+    leaf_count = 0;
+    object_nodes.clear();
+    changed();
+
+    if( count == 0 || ( uint64_t )count * 2 >= MAX_NODE_COUNT ) {
+        nodes.push_back( Node() );
+        return;
+    }
+
+    // Every leaf and internal node is known ahead of time, no reallocation occurs
+    nodes.reserve( count * 2 - 1 );
+
+    std::vector<uint32_t> order( count );
+    std::unique_ptr<vec3[]> centers( new vec3[count] );
+    for( uint32_t i = 0; i < count; ++i ) {
+        order[i] = i;
+        aabbs[i].center( centers[i] );
+    }
+
+    root_index = build_range( aabbs, oids, order.data(), centers.get(), 0, count, null_node, return_nodes );
+    leaf_count = count;
+}
+
+NodeID DBVH::build_range( AABB *aabbs, ObjectID *oids, uint32_t *order, vec3 *centers, uint32_t first, uint32_t last, NodeID parent, NodeID *return_nodes ) {
+    NodeID id = nodes.size();
+    nodes.push_back( Node() );
+    nodes[id].parent = parent;
+
+    // Single object, create a leaf
+    if( last - first == 1 ) {
+        nodes[id].aabb = aabbs[order[first]];
+        nodes[id].oid = oids[order[first]];
+        set_object_node( nodes[id].oid, id );
+        if( return_nodes )
+            return_nodes[order[first]] = id;
+        return id;
+    }
+
+    // Find the bounds of the centers
+    vec3 cmin, cmax;
+    glm_vec3_copy( centers[order[first]], cmin );
+    glm_vec3_copy( centers[order[first]], cmax );
+    for( uint32_t i = first + 1; i < last; ++i ) {
+        glm_vec3_minv( cmin, centers[order[i]], cmin );
+        glm_vec3_maxv( cmax, centers[order[i]], cmax );
+    }
+
+    // Split along the largest axis
+    uint8_t axis = 0;
+    vec3 extent;
+    glm_vec3_sub( cmax, cmin, extent );
+    if( extent[1] > extent[axis] )
+        axis = 1;
+    if( extent[2] > extent[axis] )
+        axis = 2;
+
+    uint32_t mid = first + ( last - first ) / 2;
+
+    if( extent[axis] > 0 ) {
+        // Fill the bins
+        AABB bin_bounds[SAH_BIN_COUNT];
+        uint32_t bin_counts[SAH_BIN_COUNT] = {0};
+        float scale = SAH_BIN_COUNT / extent[axis];
+        uint32_t b;
+        for( uint32_t i = first; i < last; ++i ) {
+            b = std::min( ( uint32_t )( ( centers[order[i]][axis] - cmin[axis] ) * scale ), SAH_BIN_COUNT - 1 );
+            bin_bounds[b] = bin_counts[b] ? bin_bounds[b] | aabbs[order[i]] : aabbs[order[i]];
+            ++bin_counts[b];
+        }
+
+        // Sweep from the right to find the cost of each right side
+        float right_cost[SAH_BIN_COUNT];
+        AABB sweep;
+        uint32_t sweep_count = 0;
+        for( b = SAH_BIN_COUNT - 1; b > 0; --b ) {
+            if( bin_counts[b] ) {
+                sweep = sweep_count ? sweep | bin_bounds[b] : bin_bounds[b];
+                sweep_count += bin_counts[b];
+            }
+            right_cost[b] = sweep_count ? sweep.surface_area() * sweep_count : 0;
+        }
+
+        // Sweep from the left, the split is after bin b
+        float cost, best_cost = INFINITY;
+        uint32_t best_split = SAH_BIN_COUNT;
+        sweep_count = 0;
+        for( b = 0; b < SAH_BIN_COUNT - 1; ++b ) {
+            if( bin_counts[b] ) {
+                sweep = sweep_count ? sweep | bin_bounds[b] : bin_bounds[b];
+                sweep_count += bin_counts[b];
+            }
+            if( sweep_count == 0 || sweep_count == last - first )
+                continue;
+            cost = sweep.surface_area() * sweep_count + right_cost[b + 1];
+            if( cost < best_cost ) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        // Partition the range by the chosen bin
+        if( best_split != SAH_BIN_COUNT ) {
+            uint32_t *split = std::partition( order + first, order + last, [&]( uint32_t i ) {
+                return std::min( ( uint32_t )( ( centers[i][axis] - cmin[axis] ) * scale ), SAH_BIN_COUNT - 1 ) <= best_split;
+            } );
+            mid = split - order;
+        }
+    }
+    else {
+        // All centers are the same, split by count
+        mid = first + ( last - first ) / 2;
+    }
+
+    NodeID child1 = build_range( aabbs, oids, order, centers, first, mid, id, return_nodes );
+    NodeID child2 = build_range( aabbs, oids, order, centers, mid, last, id, return_nodes );
+    nodes[id].child1 = child1;
+    nodes[id].child2 = child2;
+    nodes[id].aabb = nodes[child1].aabb | nodes[child2].aabb;
+    return id;
+}
+
+void DBVH::rebuild() {
+    std::vector<AABB> aabbs;
+    std::vector<ObjectID> oids;
+    aabbs.reserve( leaf_count );
+    oids.reserve( leaf_count );
+    for( Node &n : nodes ) {
+        if( n.isLeaf() ) {
+            aabbs.push_back( n.aabb );
+            oids.push_back( n.oid );
+        }
+    }
+    build( aabbs.data(), oids.data(), aabbs.size() );
+}
+
+/*
+ * A background rebuild owns a copy of the leaves and the tree it builds.
+ * The job is shared with the worker thread so it remains valid if the DBVH is destroyed first.
+ */
+struct DBVHRebuild {
+    std::vector<AABB> aabbs;
+    std::vector<ObjectID> oids;
+    DBVH result;
+    uint32_t revision = 0;
+    std::atomic<bool> done = false;
+};
+
+void DBVH::start_rebuild() {
+    if( rebuild_job )
+        return;
+
+    std::shared_ptr<DBVHRebuild> job = std::make_shared<DBVHRebuild>();
+    job->revision = revision;
+    job->aabbs.reserve( leaf_count );
+    job->oids.reserve( leaf_count );
+    for( Node &n : nodes ) {
+        if( n.isLeaf() ) {
+            job->aabbs.push_back( n.aabb );
+            job->oids.push_back( n.oid );
+        }
+    }
+    rebuild_job = job;
+
+    std::thread( [job]() {
+        job->result.build( job->aabbs.data(), job->oids.data(), job->aabbs.size() );
+        job->done = true;
+    } ).detach();
+}
+
+bool DBVH::finish_rebuild() {
+    if( !rebuild_job || !rebuild_job->done )
+        return false;
+
+    std::shared_ptr<DBVHRebuild> job = rebuild_job;
+    rebuild_job.reset();
+
+    // The tree changed while rebuilding, the result is out of date
+    if( job->revision != revision )
+        return false;
+
+    nodes.swap( job->result.nodes );
+    root_index = job->result.root_index;
+    leaf_count = job->result.leaf_count;
+    free_list = job->result.free_list;
+    object_nodes.swap( job->result.object_nodes );
+    changed();
+    return true;
+}
 
 NodeID DBVH::insert( AABB &aabb, ObjectID oid ) {
 
@@ -100,23 +356,46 @@ NodeID DBVH::insert( AABB &aabb, ObjectID oid ) {
     if( !nodes[root_index].isLeaf() && !nodes[root_index].hasChildren()) {
         nodes[root_index].oid = oid;
         nodes[root_index].aabb = aabb;
+        set_object_node( oid, root_index );
         leaf_count++;
+        changed();
         return root_index;
     }
 
+    // Create the leaf and place it
+    NodeID new_id = nextEmpty();
+    nodes[new_id] = Node(aabb, null_node, oid );
+    set_object_node( oid, new_id );
+    insert_leaf( new_id );
+
+    leaf_count++;
+    changed();
+    return new_id;
+}
+
+/*
+ * Places an existing leaf into a tree that has at least one other leaf.
+ */
+void DBVH::insert_leaf( NodeID leaf_id ) {
+    // Copied, the node list may expand
+    AABB aabb = nodes[leaf_id].aabb;
+
     // Root is a leaf or has 2 children
     NodeID sibling_id = root_index;
     float best_cost = (nodes[root_index].aabb | aabb).volume();
     float direct_cost = 0, combined_cost;
-    node_queue.clear();
+    NodeID candidate_id;
+    node_stack.clear();
 
-    // First node is root
-    node_queue.push( root_index );
+    // First node is root, candidates are searched depth first (a parent is always costed before its children)
+    node_stack.push_back( root_index );
     Node *node, *parent;
 
-    while( !node_queue.empty() ) {
+    while( !node_stack.empty() ) {
         // Select the node
-        node = &nodes[node_queue.front()];
+        candidate_id = node_stack.back();
+        node_stack.pop_back();
+        node = &nodes[candidate_id];
         parent = node->hasParent() ? &nodes[node->parent] : nullptr;
 
         // Set direct cost to union of current node and inserted
@@ -137,24 +416,18 @@ NodeID DBVH::insert( AABB &aabb, ObjectID oid ) {
         // Node had a better cost
         if( combined_cost <= best_cost ) {
             best_cost = combined_cost;
-            sibling_id = node_queue.front();
+            sibling_id = candidate_id;
 
             // Push children if possibly better cost
             if( node->hasChildren() && node->inheritCost + aabb.volume() < best_cost ) {
-                node_queue.push( node->child1 );
-                node_queue.push( node->child2 );
+                node_stack.push_back( node->child2 );
+                node_stack.push_back( node->child1 );
             }
         }
-
-        // Remove the selected candidate
-        node_queue.pop();
     }
 
-    // Find 2 empty nodes, one becomes the new parent, the other the sibling
+    // Find an empty node to become the new parent of the sibling and the leaf
     NodeID new_parent_id = nextEmpty();
-    nodes[new_parent_id].parent = root_index;
-    NodeID new_id = nextEmpty();
-    nodes[new_id].parent = root_index;
 
     // References are created after the list may have expanded from nextEmpty(), otherwise they will be invalid
     Node &new_parent = nodes[new_parent_id], &sibling = nodes[sibling_id];
@@ -180,30 +453,227 @@ NodeID DBVH::insert( AABB &aabb, ObjectID oid ) {
     new_parent.child1 = sibling_id;
     sibling.parent = new_parent_id;
 
-    // Add the new node as the second child
-    new_parent.child2 = new_id;
-    nodes[new_id] = Node(aabb, new_parent_id, oid );
+    // Add the leaf as the second child
+    new_parent.child2 = leaf_id;
+    nodes[leaf_id].parent = new_parent_id;
 
     // Traverse up the tree from the child and refit each parent's aabb
-    while( new_parent_id != null_node){
-        nodes[new_parent_id].aabb = nodes[nodes[new_parent_id].child1].aabb | nodes[nodes[new_parent_id].child2].aabb;
-        new_parent_id = nodes[new_parent_id].parent;
+    refit( new_parent_id );
+}
+
+bool DBVH::move( NodeID id, AABB &aabb, vec3 displacement ) {
+    if( id == null_node || id >= nodes.size() || !nodes[id].isLeaf() )
+        return false;
+
+    // Enlarge by the margin, then extend in the direction of motion
+    AABB fat = aabb;
+    vec3 d;
+    fat.expand( DBVH_FAT_MARGIN );
+    glm_vec3_scale( displacement, DBVH_DISPLACEMENT_MULTIPLIER, d );
+    fat.extend( d );
+
+    // The stored box still contains the object, keep it unless it has become much larger than needed
+    if( nodes[id].aabb.contains( aabb ) ) {
+        AABB huge = fat;
+        huge.expand( 4 * DBVH_FAT_MARGIN );
+        if( huge.contains( nodes[id].aabb ) )
+            return false;
     }
 
-    leaf_count++;
-    return new_id;
+    // A single leaf is the root, and a leaf still within its parent is not worth moving, both keep their place
+    if( id == root_index || nodes[nodes[id].parent].aabb.contains( fat ) ) {
+        set_bounds( id, fat );
+        return true;
+    }
+
+    remove_leaf( id );
+    nodes[id].aabb = fat;
+    insert_leaf( id );
+    changed();
+    return true;
+}
+
+/*
+ * Sets the box of a leaf and refits its ancestors without rotating, the shape of the tree is unchanged.
+ * An up to date flat copy is patched in place rather than rebuilt.
+ */
+void DBVH::set_bounds( NodeID id, AABB &aabb ) {
+    nodes[id].aabb = aabb;
+    for( NodeID p = nodes[id].parent; p != null_node; p = nodes[p].parent )
+        nodes[p].aabb = nodes[nodes[p].child1].aabb | nodes[nodes[p].child2].aabb;
+
+    if( !flat_dirty ) {
+        for( ; id != null_node; id = nodes[id].parent )
+            flat_nodes[flat_index[id]].aabb = nodes[id].aabb;
+    }
+    ++revision;
 }
 
 void DBVH::set_object(NodeID id, ObjectID oid){
-    if(id == null_node || !nodes[id].hasParent())
+    if(id == null_node || id >= nodes.size() || !nodes[id].isLeaf())
         return;
+    set_object_node(nodes[id].oid, null_node);
     nodes[id].oid = oid;
+    set_object_node(oid, id);
+
+    // The shape of the tree is unchanged, so an up to date flat copy is patched
+    if(!flat_dirty)
+        flat_nodes[flat_index[id]].oid = oid;
+    ++revision;
+}
+
+void DBVH::set_object_node(ObjectID oid, NodeID id){
+    if(oid == null_object)
+        return;
+    if(oid >= object_nodes.size())
+        object_nodes.resize(oid + 1, null_node);
+    object_nodes[oid] = id;
 }
 
 void DBVH::clear_node(NodeID id){
-    // Clear the node and update the first empty
+    // Remove the object's entry if it still points at this node
+    if(nodes[id].isLeaf() && nodes[id].oid < object_nodes.size() && object_nodes[nodes[id].oid] == id)
+        object_nodes[nodes[id].oid] = null_node;
+
+    // Clear the node and push it to the front of the free list, the free list is linked through child1
     nodes[id] = Node();
-    empty_start_index = empty_start_index < id ? empty_start_index : id;
+    nodes[id].child1 = free_list;
+    free_list = id;
+}
+
+/*
+ * Refits each node from the given node to the root and applies a rotation at each step.
+ */
+void DBVH::refit( NodeID id ) {
+    while( id != null_node ) {
+        if( nodes[id].hasChildren() ) {
+            nodes[id].aabb = nodes[nodes[id].child1].aabb | nodes[nodes[id].child2].aabb;
+            rotate( id );
+        }
+        id = nodes[id].parent;
+    }
+}
+
+/*
+ * Tree rotation, the same as used by Bullet and Box2D dynamic trees.
+ * For a node A with children B and C, a child of one side may be swapped with the other side.
+ * ie. B is swapped with a child of C, or C is swapped with a child of B.
+ * The swap that reduces the surface area of the changed child the most is applied.
+ * The leaves below A are unchanged so A keeps the same bounds, only the changed child is refit.
+ * Leaf node ids are never changed by a rotation.
+ */
+void DBVH::rotate( NodeID id ) {
+    Node &a = nodes[id];
+    NodeID b_id = a.child1, c_id = a.child2;
+    Node &b = nodes[b_id], &c = nodes[c_id];
+
+    // Rotations are a swap of an outer node (child of A) with an inner node (grandchild of A)
+    NodeID best_outer = null_node, best_inner = null_node;
+    float best_cost = 0, cost;
+    AABB merged;
+
+    // Swap B with a child of C
+    if( c.hasChildren() ) {
+        float area = c.aabb.surface_area();
+        merged = b.aabb | nodes[c.child2].aabb;
+        cost = merged.surface_area() - area;
+        if( cost < best_cost ) {
+            best_cost = cost;
+            best_outer = b_id;
+            best_inner = c.child1;
+        }
+        merged = b.aabb | nodes[c.child1].aabb;
+        cost = merged.surface_area() - area;
+        if( cost < best_cost ) {
+            best_cost = cost;
+            best_outer = b_id;
+            best_inner = c.child2;
+        }
+    }
+
+    // Swap C with a child of B
+    if( b.hasChildren() ) {
+        float area = b.aabb.surface_area();
+        merged = c.aabb | nodes[b.child2].aabb;
+        cost = merged.surface_area() - area;
+        if( cost < best_cost ) {
+            best_cost = cost;
+            best_outer = c_id;
+            best_inner = b.child1;
+        }
+        merged = c.aabb | nodes[b.child1].aabb;
+        cost = merged.surface_area() - area;
+        if( cost < best_cost ) {
+            best_cost = cost;
+            best_outer = c_id;
+            best_inner = b.child2;
+        }
+    }
+
+    // No rotation improves the tree
+    if( best_outer == null_node )
+        return;
+
+    // Swap the outer and inner nodes
+    NodeID inner_parent = nodes[best_inner].parent;
+    if( a.child1 == best_outer )
+        a.child1 = best_inner;
+    else
+        a.child2 = best_inner;
+
+    if( nodes[inner_parent].child1 == best_inner )
+        nodes[inner_parent].child1 = best_outer;
+    else
+        nodes[inner_parent].child2 = best_outer;
+
+    nodes[best_inner].parent = id;
+    nodes[best_outer].parent = inner_parent;
+    nodes[inner_parent].aabb = nodes[nodes[inner_parent].child1].aabb | nodes[nodes[inner_parent].child2].aabb;
+}
+
+DBVHQuality DBVH::get_quality() {
+    DBVHQuality q;
+    q.leaf_count = leaf_count;
+    if( !nodes[root_index].isLeaf() && !nodes[root_index].hasChildren() )
+        return q;
+
+    // Depth first walk, the stack holds pairs of node ids and depths
+    float internal_area = 0;
+    uint64_t depth_sum = 0;
+    NodeID id, depth;
+    node_stack.clear();
+    node_stack.push_back( root_index );
+    node_stack.push_back( 0 );
+    while( !node_stack.empty() ) {
+        depth = node_stack.back();
+        node_stack.pop_back();
+        id = node_stack.back();
+        node_stack.pop_back();
+
+        Node &n = nodes[id];
+        ++q.node_count;
+        q.max_depth = std::max( q.max_depth, ( uint32_t )depth );
+
+        if( n.isLeaf() ) {
+            depth_sum += depth;
+        }
+        else if( n.hasChildren() ) {
+            internal_area += n.aabb.surface_area();
+            node_stack.push_back( n.child1 );
+            node_stack.push_back( depth + 1 );
+            node_stack.push_back( n.child2 );
+            node_stack.push_back( depth + 1 );
+        }
+    }
+
+    float root_area = nodes[root_index].aabb.surface_area();
+    q.sah_cost = root_area > 0 ? internal_area / root_area : 0;
+    q.average_leaf_depth = leaf_count > 0 ? ( float )depth_sum / leaf_count : 0;
+    return q;
+}
+
+void DBVHQuality::print() {
+    printf( "SAH Cost:%.2f Max Depth:%u Average Leaf Depth:%.2f Nodes:%u Leaves:%u\n", sah_cost, max_depth, average_leaf_depth, node_count, leaf_count );
 }
 
 /*
@@ -218,6 +688,7 @@ void DBVH::remove( NodeID node_id ) {
 
     if( node_id == root_index ) {
         // Set the root back to 0 and clear the whole list
+        set_object_node( nodes[node_id].oid, null_node );
         nodes.clear();
         leaf_count = 0;
 
@@ -225,61 +696,76 @@ void DBVH::remove( NodeID node_id ) {
         root_index = 0;
         nodes.push_back( Node() );
 
-        // Set the empty start index (finds empty nodes faster)
-        empty_start_index = root_index;
+        // There are no empty nodes besides the root
+        free_list = null_node;
+        changed();
 
         return;
     }
-    else {
-        NodeID parent_id = nodes[node_id].parent;
-        Node &parent = nodes[parent_id];
-        NodeID sibling_id = parent.child1 == node_id ? parent.child2 : parent.child1;
-        Node &sibling = nodes[sibling_id];
-
-        if( sibling.isLeaf() ) {
-            // Parent is an unecessary intermediate node, remove the parent and transfer ownership upwards
-            if( !parent.hasParent() ) {
-                // Case where the parent is root, make sibling root
-                root_index = sibling_id;
-                // Remove sibling's parent
-                sibling.parent = null_node;
+
+    remove_leaf( node_id );
+
+    // Clear the node
+    clear_node( node_id );
+
+    // Reduce the leaf count
+    --leaf_count;
+    changed();
+}
+
+/*
+ * Detaches a leaf (that is not the root) from the tree, the leaf node itself is kept.
+ */
+void DBVH::remove_leaf( NodeID node_id ) {
+    NodeID parent_id = nodes[node_id].parent;
+    Node &parent = nodes[parent_id];
+    NodeID sibling_id = parent.child1 == node_id ? parent.child2 : parent.child1;
+    Node &sibling = nodes[sibling_id];
+    NodeID refit_id;
+
+    if( sibling.isLeaf() ) {
+        // Parent is an unecessary intermediate node, remove the parent and transfer ownership upwards
+        if( !parent.hasParent() ) {
+            // Case where the parent is root, make sibling root
+            root_index = sibling_id;
+            // Remove sibling's parent
+            sibling.parent = null_node;
+        }
+        else {
+            // Parent has parent, remove intermediate parent
+
+            // Transfer ownership to parent's parent, figure out child value
+            if( nodes[parent.parent].child1 == parent_id ) {
+                nodes[parent.parent].child1 = sibling_id;
             }
             else {
-                // Parent has parent, remove intermediate parent
-
-                // Transfer ownership to parent's parent, figure out child value
-                if( nodes[parent.parent].child1 == parent_id ) {
-                    nodes[parent.parent].child1 = sibling_id;
-                }
-                else {
-                    nodes[parent.parent].child2 = sibling_id;
-                }
-                // Update sibling's parent
-                sibling.parent = parent.parent;
+                nodes[parent.parent].child2 = sibling_id;
             }
-            // Clear the parent
-            clear_node( parent_id );
+            // Update sibling's parent
+            sibling.parent = parent.parent;
         }
+        // Clear the parent
+        refit_id = sibling.parent;
+        clear_node( parent_id );
+    }
 
-        // If the sibling is not a leaf, parent the sibling's children to the parent and remove the sibling
-        else {
-            // Transfer sibling's children to parent
-            parent.child1 = sibling.child1;
-            parent.child2 = sibling.child2;
-            nodes[parent.child1].parent = sibling.parent;
-            nodes[parent.child2].parent = sibling.parent;
-
-            // Clear the sibling
-            clear_node( sibling_id );
-        }
-        // Clear the node
-        clear_node(node_id);
+    // If the sibling is not a leaf, parent the sibling's children to the parent and remove the sibling
+    else {
+        // Transfer sibling's children to parent
+        parent.child1 = sibling.child1;
+        parent.child2 = sibling.child2;
+        nodes[parent.child1].parent = sibling.parent;
+        nodes[parent.child2].parent = sibling.parent;
+
+        // Clear the sibling
+        refit_id = parent_id;
+        clear_node( sibling_id );
     }
 
-    // Reduce the leaf count
-    --leaf_count;
+    nodes[node_id].parent = null_node;
 
-    return;
+    // The removed leaf may have been the largest in its ancestors, shrink them back
+    refit( refit_id );
 }
 
 Node* DBVH::at(NodeID id){
@@ -289,10 +775,9 @@ Node* DBVH::at(NodeID id){
 }
 
 NodeID DBVH::get_nodeId(ObjectID oid){
-    for(NodeID i = 0; i < nodes.size(); ++i){
-        if(nodes[i].oid == oid)
-            return i;
-    }
+    if(oid >= object_nodes.size())
+        return null_node;
+    return object_nodes[oid];
 }
 
 void DBVH::print(){
@@ -335,73 +820,159 @@ void DBVH::debug_draw(){
 }
 
 NodeID DBVH::nextEmpty() {
-    // starting from the empty_start_index, find the next empty node
-    for( NodeID i = empty_start_index; i < nodes.size(); ++i ) {
-        if( !nodes[i].hasParent() && i != root_index ) {
-            empty_start_index = i;
-            return i;
-        }
+    // Take the first node of the free list
+    if( free_list != null_node ) {
+        NodeID id = free_list;
+        free_list = nodes[id].child1;
+        nodes[id].child1 = null_node;
+        return id;
     }
-    // Expand if no empty nodes were found
+    // Expand if no empty nodes are free
     nodes.push_back( Node() );
-    empty_start_index = nodes.size()-1;
-    return empty_start_index;
+    return nodes.size()-1;
 }
 
-void DBVH::get_intersecting( AABB &aabb, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) {
-    node_queue.clear();
-    node_queue.push(root_index);
+/*
+ * Rebuilds the flat nodes in depth-first pre-order.
+ * The first child of a node is placed directly after it, so only the skip index needs to be stored.
+ * During the build the skip holds the flat index of the parent,
+ * subtree sizes are then accumulated in reverse (children always follow their parents) to find the skip.
+ */
+void DBVH::update_flat() {
+    if( !flat_dirty )
+        return;
+
+    flat_nodes.clear();
+    flat_dirty = false;
+
+    // Empty tree, the root has no object and no children
+    if( !nodes[root_index].isLeaf() && !nodes[root_index].hasChildren() )
+        return;
+
+    flat_nodes.reserve( nodes.size() );
+    flat_index.resize( nodes.size() );
+
+    // The stack holds pairs of node ids and the flat index of their parent
+    node_stack.clear();
+    node_stack.push_back( root_index );
+    node_stack.push_back( null_node );
+
+    NodeID id, index;
+    FlatNode f;
+    while( !node_stack.empty() ) {
+        f.skip = node_stack.back();
+        node_stack.pop_back();
+        id = node_stack.back();
+        node_stack.pop_back();
+
+        index = flat_nodes.size();
+        flat_index[id] = index;
+        Node &n = nodes[id];
+        f.aabb = n.aabb;
+        f.oid = n.oid;
+        flat_nodes.push_back( f );
+
+        // The first child is pushed last so it is placed next
+        if( n.hasChildren() ) {
+            node_stack.push_back( n.child2 );
+            node_stack.push_back( index );
+            node_stack.push_back( n.child1 );
+            node_stack.push_back( index );
+        }
+    }
+
+    // Reuse the stack as the subtree size of each flat node
+    NodeID end = flat_nodes.size(), parent;
+    node_stack.assign( end, 1 );
+    for( NodeID i = end - 1; i > 0; --i ) {
+        parent = flat_nodes[i].skip;
+        node_stack[parent] += node_stack[i];
+        flat_nodes[i].skip = i + node_stack[i];
+    }
+    flat_nodes[0].skip = end;
+}
+
+/*
+ * Walk flat nodes in order, any subtree whose box fails the test is skipped.
+ * Shared by the tree and its snapshots, exclude is an object that is not returned.
+ */
+template<typename Test>
+static void flat_query( const FlatNode *nodes, NodeID end, ObjectID exclude, Test test, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) {
     return_count = 0;
+    NodeID i = 0;
+    while( i < end && return_count < max_return_count ) {
+        const FlatNode &candidate = nodes[i];
 
-    // NOTE start can equal end if the queue overflows as well as when it is empty
-    while( return_count < max_return_count && !node_queue.empty() ) {
-        Node &candidate = nodes[node_queue.front()];
+        if( !test( candidate.aabb ) ) {
+            i = candidate.skip;
+            continue;
+        }
 
-        if( candidate.aabb.intersects( aabb ) ) {
-            // If the node is an intersecting leaf, add it to the return_values
-            if( candidate.isLeaf() ) {
-                return_values[return_count] = candidate.oid;
-                ++return_count;
-            }
-            // If the node is not a leaf and has children, add its children to the queue
-            else if( candidate.hasChildren() ) {
-                node_queue.push( candidate.child1);
-                node_queue.push( candidate.child2);
-            }
+        // If the node is a passing leaf, add it to the return_values
+        if( candidate.oid != null_object && candidate.oid != exclude ) {
+            return_values[return_count] = candidate.oid;
+            ++return_count;
         }
-        // continue into the queue
-        node_queue.pop();
+        ++i;
     }
 }
 
+void DBVH::get_intersecting( AABB &aabb, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) {
+    update_flat();
+    flat_query( flat_nodes.data(), flat_nodes.size(), null_object, [&aabb]( const AABB &b ){ return b.intersects( aabb ); },
+                return_values, return_count, max_return_count );
+}
+
 void DBVH::get_intersecting( NodeID id, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) {
-    if(id == null_node)
+    return_count = 0;
+    if( id == null_node || id >= nodes.size() )
         return;
 
-    node_queue.clear();
-    node_queue.push(root_index);
-    return_count = 0;
+    // Intersecting leaves, excluding the node itself
+    update_flat();
+    AABB &aabb = nodes[id].aabb;
+    flat_query( flat_nodes.data(), flat_nodes.size(), nodes[id].oid, [&aabb]( const AABB &b ){ return b.intersects( aabb ); },
+                return_values, return_count, max_return_count );
+}
 
-    // NOTE start can equal end if the queue overflows as well as when it is empty
-    while( return_count < max_return_count && !node_queue.empty() ) {
-        Node &candidate = nodes[node_queue.front()];
+ObjectID DBVH::raycast( const vec3 origin, const vec3 dir, float &max_t ) {
+    return cast( origin, dir, nullptr, max_t, []( ObjectID, float box_t ){ return box_t; } );
+}
 
-        if( id != node_queue.front() && candidate.aabb.intersects( nodes[id].aabb ) ) {
+ObjectID DBVH::get_nearest( const vec3 pos, float &max_dist ) {
+    ObjectID oid;
+    if( !get_nearest( pos, 1, &oid, &max_dist, max_dist, []( ObjectID, float box_dist ){ return box_dist; } ) )
+        return null_object;
+    return oid;
+}
 
-            // If the node is an intersecting leaf, add it to the return_values
-            if( candidate.isLeaf() ) {
-                return_values[return_count] = candidate.oid;
-                ++return_count;
-            }
-            // If the node is not a leaf and has children, add its children to the queue
-            else if( candidate.hasChildren() ) {
-                node_queue.push( candidate.child1);
-                node_queue.push( candidate.child2);
-            }
-        }
-        // continue into the queue
-        node_queue.pop();
-    }
+void DBVH::get_in_frustum( vec4 *frustum_planes, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) {
+    update_flat();
+    flat_query( flat_nodes.data(), flat_nodes.size(), null_object, [frustum_planes]( const AABB &b ){ return b.in_frustum( frustum_planes ); },
+                return_values, return_count, max_return_count );
 }
 
+std::shared_ptr<const DBVHSnapshot> DBVH::publish() {
+    update_flat();
+    std::shared_ptr<const DBVHSnapshot> current = published.ptr.load();
+    if( current && current->version == revision )
+        return current;
+
+    // Readers holding the previous snapshot keep it alive until they are done
+    std::shared_ptr<DBVHSnapshot> snapshot = std::make_shared<DBVHSnapshot>();
+    snapshot->nodes = flat_nodes;
+    snapshot->version = revision;
+    snapshot->leaf_count = leaf_count;
+    published.ptr.store( snapshot );
+    return snapshot;
+}
 
+void DBVHSnapshot::get_intersecting( const AABB &aabb, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) const {
+    flat_query( nodes.data(), nodes.size(), null_object, [&aabb]( const AABB &b ){ return b.intersects( aabb ); },
+                return_values, return_count, max_return_count );
+}
+
+void DBVHSnapshot::get_in_frustum( vec4 *frustum_planes, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) const {
+    flat_query( nodes.data(), nodes.size(), null_object, [frustum_planes]( const AABB &b ){ return b.in_frustum( frustum_planes ); },
+                return_values, return_count, max_return_count );
+}
@@ -6,6 +6,8 @@
 #include <vector>
 #include <queue>
 #include <algorithm>
+#include <memory>
+#include <atomic>
 #include "PhysicsTypes.h"
 #include <View.h>
 
@@ -18,6 +20,10 @@
 
 static constexpr uint32_t MAX_NODE_COUNT = UINT32_MAX - 1;
 
+// Moving leaves are stored enlarged by a margin and extended along their displacement
+static constexpr float DBVH_FAT_MARGIN = 0.2f;
+static constexpr float DBVH_DISPLACEMENT_MULTIPLIER = 4.0f;
+
 
 /*
  * Bounding box structure.
@@ -32,18 +38,33 @@ class AABB {
         AABB( vec3 a,  vec3 b );
 
         void set( vec3 a,  vec3 b );
-        bool intersects( AABB & ) ;
+        bool intersects( const AABB & ) const;
         float volume() ;
+        float surface_area();
+        void center( vec3 dest );
         AABB operator|( AABB & );
         void expand( float f );
         void expand( vec3 f );
+        void extend( vec3 d );
+        bool contains( AABB & );
         void translate( vec3 pos );
         void print();
         void debug_draw();
         void debug_draw( vec3 pos );
-        bool in_frustum( vec4 *frustum_planes );
+        bool in_frustum( vec4 *frustum_planes ) const;
         bool in_frustum( vec4 *frustum_planes, vec3 pos );
         float dist_to_center(vec3 pos);
+
+        // Distance from a point to the closest point of the box, 0 if inside
+        // A lower bound for the distance to anything within the box
+        float dist_to( const vec3 pos ) const;
+
+        // Slab test of the ray origin + dir*t, inv_dir is 1/dir per axis (infinite for zero components)
+        // t is the entry distance, 0 if the origin is inside. The box is grown by extent if given.
+        bool ray_intersect( const vec3 origin, const vec3 inv_dir, float max_t, float &t, const float *extent = nullptr ) const;
+
+        inline const float* lower() const { return bounds[0]; }
+        inline const float* upper() const { return bounds[1]; }
 };
 
 struct Node {
@@ -85,60 +106,96 @@ struct Node {
     };
 };
 
-struct NodeQueue {
-        static constexpr unsigned int size = 100;
-    private:
-        NodeID data[size];
-        unsigned int start = 0;
-        unsigned int end = 0;
-
-    public:
-        inline void clear() {
-            start = 0;
-            end = 0;
-        }
-
-        inline void push( NodeID id ) {
-            if( ( end + 1 ) % size == start ) {
-                puts( "Node queue is full." );
-                fflush( stdout );
-                return;
-            }
-
-            data[end] = id;
-            end = ( end + 1 ) % size;
-        }
+/*
+ * Compact traversal node.
+ * Nodes are laid out in depth-first pre-order, the first child of a node is always the next node in the list.
+ * The skip index points past the node's subtree, it is followed when a node fails a test or is a leaf.
+ * This keeps the hot bounds separate from the parent/cost data and allows traversal without a stack or queue.
+ */
+struct FlatNode {
+    AABB aabb;
+    NodeID skip = null_node;
+    ObjectID oid = null_object;
+};
 
-        inline void pop() {
-            start = ( start + 1 ) % size;
-        }
+struct DBVHRebuild;
+class DBVHSnapshot;
 
-        inline bool empty() {
-            return start == end;
-        }
+/*
+ * The last snapshot published by a tree, loads and stores are atomic.
+ * Copying a tree copies the snapshot pointer, the snapshot itself is shared.
+ */
+struct DBVHSnapshotSlot {
+    std::atomic<std::shared_ptr<const DBVHSnapshot>> ptr;
+
+    DBVHSnapshotSlot() {};
+    DBVHSnapshotSlot( const DBVHSnapshotSlot &s ) : ptr( s.ptr.load() ) {};
+    DBVHSnapshotSlot &operator=( const DBVHSnapshotSlot &s ) {
+        ptr.store( s.ptr.load() );
+        return *this;
+    };
+};
 
-        inline NodeID front() {
-            return data[start];
-        }
+// Insert oid at distance d into the sorted nearest results (up to k), returns the new search limit
+inline float insert_nearest( ObjectID oid, float d, unsigned int k, ObjectID *return_values, float *return_dists, unsigned int &count, float limit ) {
+    unsigned int i = count < k ? count++ : k - 1;
+    while( i > 0 && return_dists[i - 1] > d ) {
+        return_values[i] = return_values[i - 1];
+        return_dists[i] = return_dists[i - 1];
+        --i;
+    }
+    return_values[i] = oid;
+    return_dists[i] = d;
+    return count == k ? return_dists[k - 1] : limit;
+}
 
-        inline NodeID back() {
-            return data[( size + end - 1 ) % size];
-        }
+/*
+ * Measurements of the tree's quality.
+ * The SAH cost is the summed surface area of all internal nodes relative to the root, lower is better.
+ */
+struct DBVHQuality {
+    float sah_cost = 0;
+    uint32_t max_depth = 0;
+    float average_leaf_depth = 0;
+    uint32_t node_count = 0;
+    uint32_t leaf_count = 0;
+
+    void print();
 };
 
 /*
  * Dynamic Bounding Volume Hierarchy Tree.
- * NOTE This is not a thread-safe structure
+ * NOTE This is not a thread-safe structure, other threads should query a published DBVHSnapshot
  * Steps can be taken to make it so, but at a cost of serial performance
  */
 class DBVH {
         std::vector<Node> nodes;
+        std::vector<FlatNode> flat_nodes;       // Pre-ordered copy of the tree used for queries
+        std::vector<NodeID> node_stack;         // Scratch stack used for insertion and flattening
+        std::vector<std::pair<float, NodeID>> node_heap;   // Scratch min-heap of flat nodes by distance, used by nearest queries
+        std::vector<NodeID> flat_index;         // Flat index of each node, valid while the flat nodes are not dirty
+        bool flat_dirty = true;                 // The flat nodes must be rebuilt before the next query
+        uint32_t revision = 0;                  // Incremented on every change, used to validate background rebuilds
+        std::shared_ptr<DBVHRebuild> rebuild_job;
+        DBVHSnapshotSlot published;
         uint32_t size;
         uint32_t leaf_count;
-        NodeID empty_start_index = 0;
+        NodeID free_list = null_node;           // First empty node, empty nodes link to the next through child1
+        std::vector<NodeID> object_nodes;       // The leaf node of each object id
         NodeID root_index = 0;
         NodeID nextEmpty();
         void clear_node( NodeID );
+        void set_object_node( ObjectID oid, NodeID id );
+        void update_flat();
+        inline void changed(){ flat_dirty = true; ++revision; };
+        void set_bounds( NodeID id, AABB &aabb );
+        void refit( NodeID id );
+        void insert_leaf( NodeID id );
+        void remove_leaf( NodeID id );
+        void rotate( NodeID id );
+        template<typename HitTest>
+        ObjectID cast( const vec3 origin, const vec3 dir, const float *extent, float &max_t, HitTest hit_test );
+        NodeID build_range( AABB *aabbs, ObjectID *oids, uint32_t *order, vec3 *centers, uint32_t first, uint32_t last, NodeID parent, NodeID *return_nodes );
 
     public:
 
@@ -147,27 +204,273 @@ class DBVH {
         // Inserts a new AABB and returns its index
         NodeID insert( AABB &aabb, ObjectID oid );
 
+        // Replaces the tree with a surface area heuristic tree built from all AABBs at once
+        // If return_nodes is given, the node id of each object is written in the same order as the input
+        void build( AABB *aabbs, ObjectID *oids, uint32_t count, NodeID *return_nodes = nullptr );
+
+        // Rebuilds the current leaves using build(), node ids of leaves will change
+        void rebuild();
+
+        // Start rebuilding the current leaves on a background thread, the tree can still be used while it runs
+        void start_rebuild();
+
+        // Replace the tree with the background rebuild if it has finished, returns true if replaced (node ids will change)
+        // The rebuild is discarded if the tree was modified after it was started
+        bool finish_rebuild();
+
+        inline bool rebuilding(){return rebuild_job != nullptr;};
+
         // Replace a node's object id given its node id
         void set_object( NodeID id, ObjectID oid );
 
         // Removes a node given its index
         void remove( NodeID id );
 
+        // Update a moving leaf, the stored box is enlarged so the tree is only changed when the object leaves it
+        // A leaf that stays within its parent's box is refit in place, otherwise it is reinserted
+        // Displacement is the motion over the step, returns true if the tree changed (the node id is kept)
+        bool move( NodeID id, AABB &aabb, vec3 displacement );
+
         Node* at( NodeID id );
 
-        // Get the node ID from an object ID
+        // Get the node ID from an object ID, returns null_node if the object is not in the tree
         NodeID get_nodeId( ObjectID );
 
         // Get intersecting leaf nodes
         void get_intersecting( AABB &aabb, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count );
         void get_intersecting( NodeID id, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count );
 
+        // Get leaf nodes within the frustum planes
+        void get_in_frustum( vec4 *frustum_planes, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count );
+
+        /*
+         * Closest leaf hit by the ray origin + dir*t with t in [0, max_t], returns null_object on a miss.
+         * hit_test(oid, box_t) is called for every leaf box the ray enters at box_t, it returns the exact distance
+         * of a hit with the object or a negative value on a miss. Children are visited nearest box first
+         * and any box further than the closest hit so far is skipped. max_t is set to the distance of the hit.
+         */
+        template<typename HitTest>
+        inline ObjectID raycast( const vec3 origin, const vec3 dir, float &max_t, HitTest hit_test ) {
+            return cast( origin, dir, nullptr, max_t, hit_test );
+        };
+
+        // Same as raycast, only the leaf boxes are tested
+        ObjectID raycast( const vec3 origin, const vec3 dir, float &max_t );
+
+        // Sweep a box along motion*t, each node is grown by the half size of the box and hit by a ray from its center
+        template<typename HitTest>
+        inline ObjectID shape_cast( AABB &box, const vec3 motion, float &max_t, HitTest hit_test ) {
+            vec3 center, extent;
+            box.center( center );
+            glm_vec3_sub( (float*)box.upper(), center, extent );
+            return cast( center, motion, extent, max_t, hit_test );
+        };
+
+        /*
+         * Up to k objects nearest to pos within max_dist, sorted nearest first, returns the number found.
+         * dist_test(oid, box_dist) returns the distance to the object, it must not be less than box_dist (the object is in its box).
+         * Nodes are visited best first by the distance to their box and the search stops once no box can hold a nearer object.
+         */
+        template<typename DistTest>
+        unsigned int get_nearest( const vec3 pos, unsigned int k, ObjectID *return_values, float *return_dists, float max_dist, DistTest dist_test );
+
+        // Nearest leaf box to pos within max_dist, max_dist is set to its distance, returns null_object if there is none
+        ObjectID get_nearest( const vec3 pos, float &max_dist );
+
+        // Copy the tree into a new snapshot and publish it, returns the snapshot
+        // An unchanged tree keeps its last snapshot. Only the thread modifying the tree may publish.
+        std::shared_ptr<const DBVHSnapshot> publish();
+
+        // The last published snapshot, nullptr before the first publish. Safe to call from any thread.
+        inline std::shared_ptr<const DBVHSnapshot> get_snapshot() const {
+            return published.ptr.load();
+        };
+
+        // Measure the tree, this walks every node
+        DBVHQuality get_quality();
+
         // Debug
         void print();
         void debug_draw();
 
         inline NodeID get_root() {return root_index;};
+        inline uint32_t node_count() {return nodes.size();};
+        inline uint32_t count() {return leaf_count;};
 
 };
 
+/*
+ * Ordered traversal shared by ray and box casts.
+ * The children of flat node i are i+1 and the skip of i+1, the nearer one is pushed last so it is popped first.
+ * Boxes are tested again when popped, as max_t may have shrunk since they were pushed.
+ */
+template<typename HitTest>
+ObjectID DBVH::cast( const vec3 origin, const vec3 dir, const float *extent, float &max_t, HitTest hit_test ) {
+    update_flat();
+    if( flat_nodes.empty() )
+        return null_object;
+
+    vec3 inv_dir = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    ObjectID closest = null_object;
+    NodeID id, child1, child2;
+    float t, t1, t2;
+    bool hit1, hit2;
+
+    node_stack.clear();
+    node_stack.push_back( 0 );
+    while( !node_stack.empty() ) {
+        id = node_stack.back();
+        node_stack.pop_back();
+        FlatNode &node = flat_nodes[id];
+
+        if( !node.aabb.ray_intersect( origin, inv_dir, max_t, t, extent ) )
+            continue;
+
+        if( node.oid != null_object ) {
+            t = hit_test( node.oid, t );
+            if( t >= 0 && t <= max_t ) {
+                max_t = t;
+                closest = node.oid;
+            }
+            continue;
+        }
+
+        child1 = id + 1;
+        child2 = flat_nodes[child1].skip;
+        hit1 = flat_nodes[child1].aabb.ray_intersect( origin, inv_dir, max_t, t1, extent );
+        hit2 = flat_nodes[child2].aabb.ray_intersect( origin, inv_dir, max_t, t2, extent );
+        if( hit1 && hit2 ) {
+            node_stack.push_back( t1 < t2 ? child2 : child1 );
+            node_stack.push_back( t1 < t2 ? child1 : child2 );
+        }
+        else if( hit1 )
+            node_stack.push_back( child1 );
+        else if( hit2 )
+            node_stack.push_back( child2 );
+    }
+    return closest;
+}
+
+template<typename DistTest>
+unsigned int DBVH::get_nearest( const vec3 pos, unsigned int k, ObjectID *return_values, float *return_dists, float max_dist, DistTest dist_test ) {
+    update_flat();
+    if( flat_nodes.empty() || k == 0 )
+        return 0;
+
+    // Min-heap on distance, std heaps are max-heaps so the comparison is reversed
+    auto further = []( const std::pair<float, NodeID> &a, const std::pair<float, NodeID> &b ) { return a.first > b.first; };
+    unsigned int count = 0;
+    float d, limit = max_dist;
+    NodeID child;
+
+    node_heap.clear();
+    node_heap.push_back( { flat_nodes[0].aabb.dist_to( pos ), 0 } );
+    while( !node_heap.empty() ) {
+        std::pop_heap( node_heap.begin(), node_heap.end(), further );
+        std::pair<float, NodeID> top = node_heap.back();
+        node_heap.pop_back();
+
+        // Every remaining box is further than the k-th nearest so far
+        if( top.first > limit )
+            break;
+
+        FlatNode &node = flat_nodes[top.second];
+        if( node.oid == null_object ) {
+            for( child = top.second + 1; child != node.skip; child = flat_nodes[child].skip ) {
+                d = flat_nodes[child].aabb.dist_to( pos );
+                if( d <= limit ) {
+                    node_heap.push_back( { d, child } );
+                    std::push_heap( node_heap.begin(), node_heap.end(), further );
+                }
+            }
+            continue;
+        }
+
+        d = dist_test( node.oid, top.first );
+        if( d <= limit )
+            limit = insert_nearest( node.oid, d, k, return_values, return_dists, count, limit );
+    }
+    return count;
+}
+
+/*
+ * An immutable copy of a DBVH, taken by DBVH::publish.
+ * Any number of threads can query a snapshot while the tree keeps changing, it is never modified once published.
+ * Queries walk the flat nodes without a stack, all traversal state is local to the call.
+ * The version is the tree's revision when the snapshot was taken, it changes whenever the tree does.
+ */
+class DBVHSnapshot {
+        std::vector<FlatNode> nodes;
+        uint32_t version = 0;
+        uint32_t leaf_count = 0;
+
+        friend class DBVH;
+
+    public:
+        inline uint32_t get_version() const {return version;};
+        inline uint32_t count() const {return leaf_count;};
+
+        // Same as the DBVH queries
+        void get_intersecting( const AABB &aabb, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) const;
+        void get_in_frustum( vec4 *frustum_planes, ObjectID *return_values, unsigned int &return_count, unsigned int max_return_count ) const;
+
+        // Same as DBVH::raycast, boxes are visited in tree order and skipped once beyond the closest hit
+        template<typename HitTest>
+        ObjectID raycast( const vec3 origin, const vec3 dir, float &max_t, HitTest hit_test ) const;
+
+        // Same as DBVH::get_nearest, boxes are visited in tree order and skipped once beyond the k-th nearest
+        template<typename DistTest>
+        unsigned int get_nearest( const vec3 pos, unsigned int k, ObjectID *return_values, float *return_dists, float max_dist, DistTest dist_test ) const;
+};
+
+template<typename HitTest>
+ObjectID DBVHSnapshot::raycast( const vec3 origin, const vec3 dir, float &max_t, HitTest hit_test ) const {
+    vec3 inv_dir = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    ObjectID closest = null_object;
+    float t;
+
+    NodeID i = 0, end = nodes.size();
+    while( i < end ) {
+        const FlatNode &node = nodes[i];
+        if( !node.aabb.ray_intersect( origin, inv_dir, max_t, t ) ) {
+            i = node.skip;
+            continue;
+        }
+        if( node.oid != null_object ) {
+            t = hit_test( node.oid, t );
+            if( t >= 0 && t <= max_t ) {
+                max_t = t;
+                closest = node.oid;
+            }
+        }
+        ++i;
+    }
+    return closest;
+}
+
+template<typename DistTest>
+unsigned int DBVHSnapshot::get_nearest( const vec3 pos, unsigned int k, ObjectID *return_values, float *return_dists, float max_dist, DistTest dist_test ) const {
+    unsigned int count = 0;
+    float d, limit = max_dist;
+    if( k == 0 )
+        return 0;
+
+    NodeID i = 0, end = nodes.size();
+    while( i < end ) {
+        const FlatNode &node = nodes[i];
+        d = node.aabb.dist_to( pos );
+        if( d > limit ) {
+            i = node.skip;
+            continue;
+        }
+        if( node.oid != null_object ) {
+            d = dist_test( node.oid, d );
+            if( d <= limit )
+                limit = insert_nearest( node.oid, d, k, return_values, return_dists, count, limit );
+        }
+        ++i;
+    }
+    return count;
+}
+
 #endif // DBVH_H
@@ -0,0 +1,39 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <cstdint>
+#include <cmath>
+#include <cglm/cglm.h>
+
+#define FIXED_FRACTION_BITS 14
+#define FIXED_ONE (1 << FIXED_FRACTION_BITS)
+
+/*
+ * Signed fixed-point number with FIXED_FRACTION_BITS of fraction, a step of about 0.00006.
+ * Values under 1024 in magnitude convert to float and back exactly, which covers the whole terrain.
+ * Conversions only multiply by a power of two and round with floor, so they add no variance of their own.
+ */
+struct Fixed {
+    int32_t raw = 0;
+
+    static inline Fixed from_raw( int32_t r ){
+        Fixed f;
+        f.raw = r;
+        return f;
+    }
+    static inline Fixed from_float( float v ){
+        return from_raw( (int32_t)floorf( v * FIXED_ONE + .5f ) );
+    }
+    inline float to_float() const {
+        return raw * (1.0f / FIXED_ONE);
+    }
+};
+
+// Round each component to the nearest fixed-point value.
+// This reduces drift between builds but does not remove it: a difference across a rounding midpoint becomes a whole step
+inline void fixed_snap( vec3 v ){
+    for( unsigned int i = 0; i < 3; ++i )
+        v[i] = Fixed::from_float( v[i] ).to_float();
+}
+
+#endif // FIXED_H
@@ -0,0 +1,439 @@
+#ifndef GJK_H
+#define GJK_H
+
+#include "CollisionShape.h"
+
+/*
+ * GJK adapted from https://github.com/kevinmoran/GJK/blob/master/GJK.h
+ * under MIT license
+ *
+ * The algorithms are templated on support functors, so a pair of known shape types is compiled without virtual calls.
+ * Support<S> applies the shape rotation once when constructed, each support evaluation is then a few dot products.
+ * CollisionShape::gjk dispatches on CollisionShape::type to these instantiations.
+ */
+
+#define GJK_MAX_ITER 64
+#define EPA_EPSILON 0.01
+#define EPA_MAX_FACES 64
+#define EPA_MAX_LOOSE_EDGES 32
+#define EPA_MAX_ITER 32
+
+/*
+ * Search direction kept between tests of the same pair, after a miss it is a separating axis
+ * Coherent pairs then usually exit on the first support point
+ */
+struct GJKCache {
+    vec3 axis = GLM_VEC3_ZERO_INIT;
+};
+
+// Store the separating axis of a miss, returns false for the GJK result
+inline bool separated( const vec3 search_dir, vec3 separating_axis ){
+    if(separating_axis)
+        glm_vec3_copy( (float*)search_dir, separating_axis );
+    return false;
+}
+
+void update_simplex3(vec3 &a, vec3 &b, vec3 &c, vec3 &d, unsigned int &simplex_dimension, vec3 &search_dir);
+bool update_simplex4(vec3 &a, vec3 &b, vec3 &c, vec3 &d, unsigned int &simplex_dimension, vec3 &search_dir);
+
+/*
+ * Falls back to the virtual support function for shapes without a specialization
+ */
+template<typename S>
+struct Support {
+    S &shape;
+    Support( S &s ) : shape(s) {}
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        shape.getSupportVector(direction, dest);
+    }
+};
+
+template<>
+struct Support<Sphere> {
+    vec3 pos;
+    float radius;
+    Support( Sphere &s ) : radius(s.radius) {
+        glm_vec3_copy(s.pos, pos);
+    }
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        vec3 dir = {direction[0],direction[1],direction[2]};
+        glm_vec3_scale( dir, radius / glm_vec3_norm( dir ), dir );
+        glm_vec3_add( dir, (float*)pos, dest );
+    }
+};
+
+template<>
+struct Support<Box> {
+    vec3 pos;
+    vec3 axes[3];   // Rotated axes scaled by the half extents
+    Support( Box &s ) {
+        glm_vec3_copy(s.pos, pos);
+        for(unsigned int i = 0; i < 3; ++i){
+            glm_vec3_zero(axes[i]);
+            axes[i][i] = s.half_extents[i];
+            glm_quat_rotatev(s.rot, axes[i], axes[i]);
+        }
+    }
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        vec3 dir = {direction[0],direction[1],direction[2]};
+        glm_vec3_copy( (float*)pos, dest );
+        for(unsigned int i = 0; i < 3; ++i){
+            if( glm_vec3_dot( dir, (float*)axes[i] ) > 0 )
+                glm_vec3_add( dest, (float*)axes[i], dest );
+            else
+                glm_vec3_sub( dest, (float*)axes[i], dest );
+        }
+    }
+};
+
+template<>
+struct Support<Cylinder> {
+    vec3 pos;
+    vec3 axis = {0,1,0};    // Rotated unit y axis
+    float radius, y_extension;
+    Support( Cylinder &s ) : radius(s.radius), y_extension(s.y_extension) {
+        glm_vec3_copy(s.pos, pos);
+        glm_quat_rotatev(s.rot, axis, axis);
+    }
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        vec3 dir = {direction[0],direction[1],direction[2]};
+
+        // Remove the axis component for the radial direction
+        float d = glm_vec3_dot( dir, (float*)axis );
+        glm_vec3_muladds( (float*)axis, -d, dir );
+        glm_vec3_normalize_to( dir, dest );
+        glm_vec3_scale( dest, radius, dest );
+
+        glm_vec3_muladds( (float*)axis, d > 0 ? y_extension : -y_extension, dest );
+        glm_vec3_add( dest, (float*)pos, dest );
+    }
+};
+
+template<>
+struct Support<Capsule> {
+    vec3 pos;
+    vec3 axis = {0,1,0};    // Rotated unit y axis
+    float radius, y_extension;
+    Support( Capsule &s ) : radius(s.radius), y_extension(s.y_extension) {
+        glm_vec3_copy(s.pos, pos);
+        glm_quat_rotatev(s.rot, axis, axis);
+    }
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        vec3 dir = {direction[0],direction[1],direction[2]};
+        glm_vec3_normalize_to( dir, dest );
+        glm_vec3_scale( dest, radius, dest );
+
+        glm_vec3_muladds( (float*)axis, glm_vec3_dot( dir, (float*)axis ) > 0 ? y_extension : -y_extension, dest );
+        glm_vec3_add( dest, (float*)pos, dest );
+    }
+};
+
+template<>
+struct Support<Triangle> {
+    vec3 points[3];     // Translated points
+    vec3 normal;
+    Support( Triangle &s ) {
+        for(unsigned int i = 0; i < 3; ++i)
+            glm_vec3_add( s.points[i], s.pos, points[i] );
+        vec3 ab, ac;
+        glm_vec3_sub( s.points[1], s.points[0], ab );
+        glm_vec3_sub( s.points[2], s.points[0], ac );
+        glm_vec3_cross( ab, ac, normal );
+    }
+    inline void operator()( const vec3 direction, vec3 &dest ) const {
+        vec3 dir = {direction[0],direction[1],direction[2]};
+        float d0 = glm_vec3_dot( (float*)points[0], dir );
+        float d1 = glm_vec3_dot( (float*)points[1], dir );
+        float d2 = glm_vec3_dot( (float*)points[2], dir );
+
+        if( d1 > d0 )
+            glm_vec3_copy( (float*)points[d2 > d1 ? 2 : 1], dest );
+        else
+            glm_vec3_copy( (float*)points[d2 > d0 ? 2 : 0], dest );
+
+        // Depth behind triangle (prism like)
+        if( glm_vec3_dot( dir, (float*)normal ) < 0 )
+            glm_vec3_sub( dest, (float*)normal, dest );
+    }
+};
+
+template<typename SA, typename SB>
+void epa( vec3 a, vec3 b, vec3 c, vec3 d, const SA &support_a, const SB &support_b, vec3 resolve){
+
+    vec3 faces[EPA_MAX_FACES][4];
+
+    vec3 t1,t2;
+    glm_vec3_sub(b,a,t1);
+    glm_vec3_sub(c,a,t2);
+
+    // Initialize from GJK simplex
+    // abc
+    glm_vec3_copy(a, faces[0][0]);
+    glm_vec3_copy(b, faces[0][1]);
+    glm_vec3_copy(c, faces[0][2]);
+    glm_vec3_cross(t1, t2, faces[0][3]);
+    glm_vec3_normalize(faces[0][3]);
+
+    // acd
+    glm_vec3_copy(a, faces[1][0]);
+    glm_vec3_copy(c, faces[1][1]);
+    glm_vec3_copy(d, faces[1][2]);
+    glm_vec3_sub(d,a,t1);
+    glm_vec3_cross(t2, t1, faces[1][3]);
+    glm_vec3_normalize(faces[1][3]);
+
+    // adb
+    glm_vec3_copy(a, faces[2][0]);
+    glm_vec3_copy(d, faces[2][1]);
+    glm_vec3_copy(b, faces[2][2]);
+    glm_vec3_sub(b,a,t2);
+    glm_vec3_cross(t1, t2, faces[2][3]);
+    glm_vec3_normalize(faces[2][3]);
+
+    // bdc
+    glm_vec3_copy(b, faces[3][0]);
+    glm_vec3_copy(d, faces[3][1]);
+    glm_vec3_copy(c, faces[3][2]);
+    glm_vec3_sub(d,b,t1);
+    glm_vec3_sub(c,b,t2);
+    glm_vec3_cross(t1, t2, faces[3][3]);
+    glm_vec3_normalize(faces[3][3]);
+
+    unsigned int face_count = 4, closest_face;
+    vec3 search_dir, inv_search_dir, p, t;
+    vec3 loose_edges[EPA_MAX_LOOSE_EDGES][2];
+    for(unsigned int iteration = 0; iteration < face_count; ++iteration ){
+
+        // Find the closest face to the origin
+        float min_distance = glm_vec3_dot(faces[0][0], faces[0][3]);
+        float distance;
+        closest_face = 0;
+        for(unsigned int i = 1; i < face_count; ++i ){
+            distance = glm_vec3_dot(faces[i][0], faces[i][3]);
+            if(distance < min_distance){
+                min_distance = distance;
+                closest_face = i;
+            }
+        }
+
+        // Look along the normal of the closest face for a support vector
+        vec3 sa,sb;
+        glm_vec3_copy(faces[closest_face][3], search_dir);
+        glm_vec3_negate_to(search_dir, inv_search_dir);
+        support_a(search_dir, sa);
+        support_b(inv_search_dir, sb);
+        glm_vec3_sub(sa,sb,p);
+
+        // The new point is within error from the origin, resolve by dot of point with closest face
+        if(glm_vec3_dot(p, search_dir) - min_distance < EPA_EPSILON ){
+            glm_vec3_scale(faces[closest_face][3], glm_vec3_dot(p, search_dir), resolve);
+            return;
+        }
+
+
+        // Find all triangles that face the new point
+        unsigned int loose_edge_count = 0;
+        for(unsigned int i = 0; i < face_count; ++i ){
+
+            // Remove the trinagle if it faces new point
+            glm_vec3_sub(p,faces[i][0],t);
+            if(glm_vec3_dot(faces[i][3], t) > 0){
+
+                // Insert edges into loose edge list, if already present, remove the edge
+                for(unsigned int e = 0; e < 3; ++e){
+                    vec3 ce[2];
+                    glm_vec3_copy(faces[i][e], ce[0]);
+                    glm_vec3_copy(faces[i][(e+1)%3], ce[1]);
+                    bool edge_found = false;
+
+                    for(unsigned int le = 0; le < loose_edge_count; ++le){
+                        // If the points in the current edge match the loose edge
+                        if( glm_vec3_eqv(loose_edges[le][1], ce[0]) && glm_vec3_eqv(loose_edges[le][0], ce[1])){
+                            // Replace current edge with last edge
+                            glm_vec3_copy(loose_edges[loose_edge_count-1][0],loose_edges[le][0]);
+                            glm_vec3_copy(loose_edges[loose_edge_count-1][1],loose_edges[le][1]);
+                            --loose_edge_count;
+                            edge_found = true;
+                            // Breaks the loop
+                            le = loose_edge_count;
+                        }
+                    }
+
+                    // Add the edge if it does not already exist
+                    if(!edge_found){
+                        // Discontinue if there are too many edges added
+                        if(loose_edge_count >= EPA_MAX_LOOSE_EDGES)
+                            break;
+                        glm_vec3_copy(ce[0], loose_edges[loose_edge_count][0]);
+                        glm_vec3_copy(ce[1], loose_edges[loose_edge_count][1]);
+                        ++loose_edge_count;
+                    }
+                }
+
+                // Remove the current face from the list
+                glm_vec3_copy(faces[face_count-1][0],faces[i][0]);
+                glm_vec3_copy(faces[face_count-1][1],faces[i][1]);
+                glm_vec3_copy(faces[face_count-1][2],faces[i][2]);
+                glm_vec3_copy(faces[face_count-1][3],faces[i][3]);
+                --face_count;
+                --i;
+            }
+            // Triangle does not face new point
+        }
+
+        // Rebuild the polytope with the new point
+        vec3 t1,t2;
+        for(unsigned int i=0; i < loose_edge_count; ++i){
+            if(face_count >= EPA_MAX_FACES)
+                break;
+            glm_vec3_copy( loose_edges[i][0], faces[face_count][0]);
+            glm_vec3_copy( loose_edges[i][1], faces[face_count][1]);
+            glm_vec3_copy( p, faces[face_count][2]);
+            glm_vec3_sub(loose_edges[i][0], loose_edges[i][1], t1);
+            glm_vec3_sub(loose_edges[i][0], p, t2);
+            glm_vec3_cross( t1,t2, faces[face_count][3]);
+            glm_vec3_normalize(faces[face_count][3]);
+
+            // Ensure normal is correct, reverse the winding order
+            if(glm_vec3_dot(faces[face_count][0], faces[face_count][3])+ .000001 < 0){
+                glm_vec3_copy(faces[face_count][0], t1);
+                glm_vec3_copy(faces[face_count][1], faces[face_count][0]);
+                glm_vec3_copy(t1, faces[face_count][1]);
+                glm_vec3_inv(faces[face_count][3]);
+            }
+            ++face_count;
+        }
+    }
+    // EPA did not converge to meet error limit, return closest point
+    glm_vec3_scale(faces[closest_face][3], glm_vec3_dot(faces[closest_face][0], faces[closest_face][3]), resolve);
+
+    return;
+}
+
+template<typename SA, typename SB>
+bool gjk_support(const SA &support_a, const SB &support_b, const vec3 initial_dir, vec3 resolve, vec3 separating_axis = nullptr){
+
+    // Declare simplex
+    vec3
+    a = GLM_VEC3_ZERO_INIT,
+    b = GLM_VEC3_ZERO_INIT,
+    c = GLM_VEC3_ZERO_INIT,
+    d = GLM_VEC3_ZERO_INIT;
+
+    // Initial search direction
+    vec3 search_dir = {initial_dir[0], initial_dir[1], initial_dir[2]}, inv_search_dir;
+    if(glm_vec3_eq(search_dir,0))
+        search_dir[0] = 1;
+    glm_vec3_negate_to(search_dir, inv_search_dir);
+
+    // First simplex point, subtract the support vectors of both shapes in direction
+    vec3 s1,s2;
+    support_a(search_dir, s1);
+    support_b(inv_search_dir, s2);
+    glm_vec3_sub(s1, s2, c);
+
+    // The furthest point along the initial direction did not reach the origin, true for a cached separating axis
+    if(glm_vec3_dot(c, search_dir) < 0){
+        return separated(search_dir, separating_axis);
+    }
+
+    // Set the search direction towards the origin
+    glm_vec3_copy(c, inv_search_dir);
+    glm_vec3_negate_to(inv_search_dir,search_dir);
+
+    // Second simplex point
+    support_a(search_dir, s1);
+    support_b(inv_search_dir, s2);
+    glm_vec3_sub(s1, s2, b);
+
+    // Exit if the furthest point did not cross the origin (no collision)
+    if(glm_vec3_dot(b, search_dir) < 0){
+        return separated(search_dir, separating_axis);
+    }
+
+    // Set the search direction perpendicular to the line segment towards the origin
+    glm_vec3_sub(c, b, s1);
+    glm_vec3_negate_to(b, s2);
+    glm_vec3_cross(s1, s2, search_dir);
+    glm_vec3_cross(search_dir, s1, search_dir);
+
+    // If the origin is on the line segment, any normal search vector is valid
+    if( glm_vec3_eq_eps(search_dir,0)){
+        // Try X axis first
+        vec3 axis = {1,0,0};
+        glm_vec3_cross(s1, axis, search_dir);
+
+        // Try Z axis second
+        if(glm_vec3_eq_eps(search_dir, 0)){
+            axis[0] = 0;
+            axis[2] = -1;
+            glm_vec3_cross(s1, axis,search_dir);
+        }
+    }
+    glm_vec3_negate_to(search_dir, inv_search_dir);
+
+    // Set the simplex dimension
+    unsigned int simplex_dimension = 2;
+
+    for(unsigned int i = 0; i < GJK_MAX_ITER; ++i){
+        glm_vec3_negate_to(search_dir, inv_search_dir);
+        support_a(search_dir, s1);
+        support_b(inv_search_dir, s2);
+        glm_vec3_sub(s1, s2, a);
+
+        // New point could not enclose the origin
+        if(glm_vec3_dot(a, search_dir) < 0){
+            return separated(search_dir, separating_axis);
+        }
+
+        ++simplex_dimension;
+
+        // Update triangle simplex
+        if(simplex_dimension == 3){
+            update_simplex3(a,b,c,d, simplex_dimension, search_dir);
+        }
+        // Update tetrahedron simplex
+        else if( update_simplex4(a,b,c,d, simplex_dimension, search_dir) ){
+            // If the overlap information is requested, compute EPA
+            if(resolve){
+                epa(a,b,c,d,support_a, support_b, resolve);
+            }
+
+            return true;
+        }
+    }
+    // Simplex did not enclose the origin
+    return false;
+}
+
+/*
+ * GJK for two shapes of known types, the types only need a Support specialization
+ */
+template<typename A, typename B>
+inline bool gjk( A &shape_a, B &shape_b, vec3 resolve = nullptr ){
+    vec3 dir;
+    glm_vec3_sub(shape_b.pos, shape_a.pos, dir);
+    return gjk_support(Support<A>(shape_a), Support<B>(shape_b), dir, resolve);
+}
+
+/*
+ * GJK seeded from the cache of the pair, the cache is updated with the new search direction
+ */
+template<typename A, typename B>
+inline bool gjk( A &shape_a, B &shape_b, GJKCache &cache, vec3 resolve = nullptr ){
+    vec3 dir;
+    if(glm_vec3_eq(cache.axis, 0))
+        glm_vec3_sub(shape_b.pos, shape_a.pos, dir);
+    else
+        glm_vec3_copy(cache.axis, dir);
+
+    if(!gjk_support(Support<A>(shape_a), Support<B>(shape_b), dir, resolve, cache.axis))
+        return false;
+
+    // Colliding pairs search along the penetration next time
+    if(resolve && !glm_vec3_eq(resolve, 0))
+        glm_vec3_copy(resolve, cache.axis);
+    return true;
+}
+
+#endif // GJK_H
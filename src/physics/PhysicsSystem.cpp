@@ -1,11 +1,417 @@
 #include "PhysicsSystem.h"
 
-void PhysicsSystem::init(){
-
+void PhysicsSystem::init(uint32_t worker_count){
+    workers.init(worker_count);
 }
 
 void PhysicsSystem::update(){
-    // Apply motion/transforms for dynamic dynamic_objects
+    ++step;
+    contact_events.clear();
+
+    integrate();
+    find_pairs();
+    narrowphase();
+    apply_corrections();
+    if(PHYSICS_DETERMINISTIC)
+        snap_state();
+    update_contacts();
+    update_islands();
+
+    // Swap in a finished static rebuild, otherwise start one if the static tree has changed enough
+    if(static_dbvh.finish_rebuild()){
+        update_static_nodes();
+        static_changes = 0;
+    }
+    else if(static_changes >= STATIC_REBUILD_CHANGES && !static_dbvh.rebuilding()){
+        static_dbvh.start_rebuild();
+    }
+
+    // Publish the trees for readers on other threads
+    dynamic_dbvh.publish();
+    static_dbvh.publish();
+}
+
+void PhysicsSystem::integrate(){
+    // Fast objects are swept before anything moves, so every sweep starts from the positions of the last step
+    float extent;
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &d = dynamic_objects[oid];
+        d.toi = 1;
+        if(d.empty() || !d.awake || glm_vec3_norm2(d.velocity) == 0)
+            continue;
+        extent = INFINITY;
+        for(unsigned int i = 0; i < 3; ++i)
+            extent = std::min(extent, d.shape->aabb.upper()[i] - d.shape->aabb.lower()[i]);
+        extent *= CCD_MOTION_FRACTION;
+        if(glm_vec3_norm2(d.velocity) > extent*extent)
+            d.toi = time_of_impact(oid);
+    }
+
+    // Apply motion for dynamic objects, the tree only changes when a shape leaves its enlarged box
+    vec3 motion;
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &d = dynamic_objects[oid];
+        if(d.empty() || !d.awake || glm_vec3_norm2(d.velocity) == 0)
+            continue;
+        glm_vec3_scale(d.velocity, d.toi, motion);
+        glm_vec3_add(d.shape->pos, motion, d.shape->pos);
+        move_dynamic_object(oid, motion);
+    }
+}
+
+float PhysicsSystem::time_of_impact(ObjectID oid){
+    DynamicObject &d = dynamic_objects[oid];
+    float toi = 1, t;
+
+    // The object is moved to the contact, so the narrowphase finds the pair and removes the velocity into it
+    static_dbvh.shape_cast(d.shape->aabb, d.velocity, toi, [&](ObjectID o, float){
+        return CollisionShape::sweep(*d.shape, *static_objects[o].shape, d.velocity, t) ? t : -1.0f;
+    });
+
+    // Dynamic objects are swept with the relative motion, their enlarged boxes cover the motion of the other object
+    vec3 relative;
+    dynamic_dbvh.shape_cast(d.shape->aabb, d.velocity, toi, [&](ObjectID o, float){
+        DynamicObject &other = dynamic_objects[o];
+        if(o == oid)
+            return -1.0f;
+        glm_vec3_copy(d.velocity, relative);
+        if(other.awake)
+            glm_vec3_sub(relative, other.velocity, relative);
+        return CollisionShape::sweep(*d.shape, *other.shape, relative, t) ? t : -1.0f;
+    });
+    return toi;
+}
+
+void PhysicsSystem::find_pairs(){
+    ObjectID *candidates;
+    unsigned int count;
+    active_pairs.clear();
+
+    // A query that fills the buffer may have been cut short, so the buffer grows and the query is repeated
+    auto query = [&](auto &&get_intersecting){
+        for(;;){
+            get_intersecting(pair_candidates.data(), count, pair_candidates.size());
+            if(count < pair_candidates.size())
+                break;
+            pair_candidates.resize(pair_candidates.size() * 2);
+        }
+        candidates = pair_candidates.data();
+    };
+
+    for(ObjectID a = 0; a < dynamic_objects.size(); ++a){
+        DynamicObject &d = dynamic_objects[a];
+        if(d.empty() || !d.awake)
+            continue;
+
+        // Pairs are owned by the lesser id, so lesser awake candidates have already been added
+        // Sleeping objects do not search, so pairs with them are added by the awake object
+        query([&](ObjectID *values, unsigned int &n, unsigned int max_n){
+            dynamic_dbvh.get_intersecting(d.dbvh_node, values, n, max_n);
+        });
+        for(unsigned int i = 0; i < count; ++i){
+            if(candidates[i] > a)
+                add_pair(a, candidates[i], false);
+            else if(!dynamic_objects[candidates[i]].awake)
+                add_pair(candidates[i], a, false);
+        }
+
+        // Static objects can not initiate pairs, so all of them are considered
+        query([&](ObjectID *values, unsigned int &n, unsigned int max_n){
+            static_dbvh.get_intersecting(dynamic_dbvh.at(d.dbvh_node)->aabb, values, n, max_n);
+        });
+        for(unsigned int i = 0; i < count; ++i)
+            add_pair(a, candidates[i], true);
+    }
+
+    // Candidates come in tree order, which depends on rebuild timing, so pairs are sorted for a fixed correction order
+    std::sort(active_pairs.begin(), active_pairs.end(), [](ContactPair *p, ContactPair *q){
+        return pair_key(p->a, p->b, p->b_static) < pair_key(q->a, q->b, q->b_static);
+    });
+}
+
+void PhysicsSystem::add_pair(ObjectID a, ObjectID b, bool b_static){
+    // Existing pairs keep their contact state, new pairs are created untouched
+    auto [it, inserted] = pairs.try_emplace(pair_key(a, b, b_static));
+    ContactPair &p = it->second;
+    if(inserted){
+        p.a = a;
+        p.b = b;
+        p.b_static = b_static;
+    }
+    p.step = step;
+    active_pairs.push_back(&p);
+}
+
+void PhysicsSystem::narrowphase(){
+    for(uint32_t w = 0; w < workers.size(); ++w)
+        worker_contacts[w].clear();
+
+    // Only pairs whose enlarged boxes still overlap are tested, shapes are only read by the workers
+    // A pair is only tested by one job, so its GJK cache can be written
+    uint32_t pair_count = active_pairs.size();
+    uint32_t job_count = (pair_count + NARROWPHASE_JOB_SIZE - 1) / NARROWPHASE_JOB_SIZE;
+    workers.run(job_count, [this, pair_count](uint32_t job, uint32_t worker){
+        vector<NarrowphaseResult> &out = worker_contacts[worker];
+        uint32_t end = std::min(pair_count, (job + 1) * NARROWPHASE_JOB_SIZE);
+        NarrowphaseResult r;
+        for(uint32_t i = job * NARROWPHASE_JOB_SIZE; i < end; ++i){
+            ContactPair *p = active_pairs[i];
+            CollisionShape *a = dynamic_objects[p->a].shape;
+            CollisionShape *b = p->b_static ? static_objects[p->b].shape : dynamic_objects[p->b].shape;
+            r.pair = i;
+            glm_vec3_zero(r.resolve);
+            r.colliding = CollisionShape::collide(*a, *b, r.resolve, &p->gjk_cache);
+            out.push_back(r);
+        }
+    });
+
+    // Every pair has exactly one result, so the merge does not depend on which worker ran a job
+    for(uint32_t w = 0; w < workers.size(); ++w){
+        for(NarrowphaseResult &r : worker_contacts[w]){
+            ContactPair *p = active_pairs[r.pair];
+            p->colliding = r.colliding;
+            glm_vec3_copy(r.resolve, p->resolve);
+        }
+    }
+}
+
+void PhysicsSystem::apply_corrections(){
+    // Accumulate corrections first so the result does not depend on pair order
+    vec3 half;
+    for(ContactPair *p : active_pairs){
+        if(!p->colliding)
+            continue;
+
+        // An awake object hit a sleeping island
+        if(!p->b_static)
+            wake_island(dynamic_objects[p->a].awake ? p->b : p->a);
+        if(p->b_static){
+            glm_vec3_sub(dynamic_objects[p->a].correction, p->resolve, dynamic_objects[p->a].correction);
+            continue;
+        }
+        glm_vec3_scale(p->resolve, .5, half);
+        glm_vec3_sub(dynamic_objects[p->a].correction, half, dynamic_objects[p->a].correction);
+        glm_vec3_add(dynamic_objects[p->b].correction, half, dynamic_objects[p->b].correction);
+    }
+
+    vec3 n;
+    float d;
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &o = dynamic_objects[oid];
+        if(o.empty() || glm_vec3_norm2(o.correction) == 0)
+            continue;
+
+        // Remove any velocity going into the contact
+        glm_vec3_normalize_to(o.correction, n);
+        d = glm_vec3_dot(o.velocity, n);
+        if(d < 0)
+            glm_vec3_muladds(n, -d, o.velocity);
+
+        glm_vec3_add(o.shape->pos, o.correction, o.shape->pos);
+        move_dynamic_object(oid, o.correction);
+        glm_vec3_zero(o.correction);
+    }
+}
+
+void PhysicsSystem::snap_state(){
+    // The change is far under the enlarged box margin, so the tree is not updated
+    for(DynamicObject &d : dynamic_objects){
+        if(d.empty() || !d.awake)
+            continue;
+        fixed_snap(d.shape->pos);
+        fixed_snap(d.velocity);
+        d.shape->updateAABB();
+    }
+}
+
+void PhysicsSystem::update_contacts(){
+    // Active pairs are in ascending object order, keeping the event order stable
+    for(ContactPair *p : active_pairs){
+        if(p->colliding && !p->touching){
+            DynamicObject &a = dynamic_objects[p->a];
+            p->contact_a = a.add_contact(p->b, p->b_static);
+            EntityID owner_b;
+            if(p->b_static){
+                owner_b = static_objects[p->b].owner;
+            }
+            else{
+                p->contact_b = dynamic_objects[p->b].add_contact(p->a, false);
+                owner_b = dynamic_objects[p->b].owner;
+            }
+            p->touching = true;
+            contact_events.push_back({a.owner, owner_b, true, p->contact_a, p->contact_b});
+        }
+        else if(!p->colliding && p->touching){
+            end_contact(*p);
+        }
+    }
+
+    // Pairs that were not found this step no longer overlap, unless both objects are sleeping
+    ended_pairs.clear();
+    for(auto &[key, p] : pairs){
+        if(p.step == step || (!dynamic_objects[p.a].awake && (p.b_static || !dynamic_objects[p.b].awake)))
+            continue;
+        ended_pairs.push_back(key);
+    }
+    end_pairs();
+}
+
+void PhysicsSystem::end_pairs(){
+    std::sort(ended_pairs.begin(), ended_pairs.end());
+    for(uint64_t key : ended_pairs){
+        auto it = pairs.find(key);
+        if(it->second.touching)
+            end_contact(it->second);
+        pairs.erase(it);
+    }
+    ended_pairs.clear();
+}
+
+ObjectID PhysicsSystem::find_island(ObjectID oid){
+    // Path halving
+    while(island_parent[oid] != oid){
+        island_parent[oid] = island_parent[island_parent[oid]];
+        oid = island_parent[oid];
+    }
+    return oid;
+}
+
+void PhysicsSystem::update_islands(){
+    // Awake objects that touch form an island, static objects do not join islands
+    island_parent.resize(dynamic_objects.size());
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid)
+        island_parent[oid] = oid;
+
+    ObjectID ra, rb;
+    for(ContactPair *p : active_pairs){
+        if(!p->touching || p->b_static)
+            continue;
+        ra = find_island(p->a);
+        rb = find_island(p->b);
+        if(ra != rb)
+            island_parent[std::max(ra, rb)] = std::min(ra, rb);
+    }
+
+    // Count still steps, the lowest count of an island is stored on its root
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &d = dynamic_objects[oid];
+        if(d.empty() || !d.awake)
+            continue;
+        if(glm_vec3_norm2(d.velocity) < SLEEP_VELOCITY*SLEEP_VELOCITY){
+            if(d.still_steps < SLEEP_STEPS)
+                ++d.still_steps;
+        }
+        else{
+            d.still_steps = 0;
+        }
+    }
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &d = dynamic_objects[oid];
+        if(d.empty() || !d.awake)
+            continue;
+        DynamicObject &root = dynamic_objects[find_island(oid)];
+        root.still_steps = std::min(root.still_steps, d.still_steps);
+    }
+
+    // Islands that have all been still long enough go to sleep, members are linked from the root
+    for(ObjectID oid = 0; oid < dynamic_objects.size(); ++oid){
+        DynamicObject &d = dynamic_objects[oid];
+        if(d.empty() || !d.awake)
+            continue;
+        ObjectID root = find_island(oid);
+        if(dynamic_objects[root].still_steps < SLEEP_STEPS)
+            continue;
+        d.awake = false;
+        glm_vec3_zero(d.velocity);
+        d.island = root;
+        if(oid != root){
+            d.next_in_island = dynamic_objects[root].next_in_island;
+            dynamic_objects[root].next_in_island = oid;
+        }
+    }
+}
+
+void PhysicsSystem::wake_island(ObjectID oid){
+    if(dynamic_objects[oid].awake)
+        return;
+
+    ObjectID next = dynamic_objects[oid].island;
+    while(next != null_object){
+        DynamicObject &d = dynamic_objects[next];
+        next = d.next_in_island;
+        d.awake = true;
+        d.still_steps = 0;
+        d.island = d.next_in_island = null_object;
+    }
+}
+
+void PhysicsSystem::wake_object(ObjectID oid){
+    if(oid == null_object || oid >= dynamic_objects.size() || dynamic_objects[oid].empty())
+        return;
+    wake_island(oid);
+}
+
+void PhysicsSystem::end_contact(ContactPair &p){
+    DynamicObject &a = dynamic_objects[p.a];
+    EntityID owner_b;
+    a.remove_contact(p.contact_a);
+    if(p.b_static){
+        owner_b = static_objects[p.b].owner;
+    }
+    else{
+        dynamic_objects[p.b].remove_contact(p.contact_b);
+        owner_b = dynamic_objects[p.b].owner;
+    }
+    contact_events.push_back({a.owner, owner_b, false, p.contact_a, p.contact_b});
+    p.touching = false;
+    p.contact_a = p.contact_b = null_contact;
+}
+
+void PhysicsSystem::remove_pairs(ObjectID oid, bool is_static){
+    // End contacts with the removed object so the other object's slots are freed
+    ended_pairs.clear();
+    for(auto &[key, p] : pairs){
+        if((!is_static && p.a == oid) || (p.b == oid && p.b_static == is_static)){
+            // Objects resting on the removed object have to fall
+            if(p.touching){
+                wake_island(p.a);
+                if(!p.b_static)
+                    wake_island(p.b);
+            }
+            ended_pairs.push_back(key);
+        }
+    }
+    end_pairs();
+}
+
+void PhysicsSystem::update_static_nodes(){
+    // Leaf node ids change after a build, point each object at its new leaf
+    Node *n;
+    for(NodeID i = 0; i < static_dbvh.node_count(); ++i){
+        n = static_dbvh.at(i);
+        if(n->isLeaf())
+            static_objects[n->oid].dbvh_node = i;
+    }
+}
+
+EntityID PhysicsSystem::raycast(const vec3 origin, const vec3 dir, float &max_t){
+    EntityID hit = null_entity;
+    float t;
+    ObjectID oid;
+
+    // Both trees share max_t, so the second cast only visits boxes in front of the first hit
+    oid = static_dbvh.raycast(origin, dir, max_t, [&](ObjectID o, float){
+        return CollisionShape::raycast(*static_objects[o].shape, origin, dir, max_t, t) ? t : -1.0f;
+    });
+    if(oid != null_object)
+        hit = static_objects[oid].owner;
+
+    oid = dynamic_dbvh.raycast(origin, dir, max_t, [&](ObjectID o, float){
+        return CollisionShape::raycast(*dynamic_objects[o].shape, origin, dir, max_t, t) ? t : -1.0f;
+    });
+    if(oid != null_object)
+        hit = dynamic_objects[oid].owner;
+    return hit;
 }
 
 void PhysicsSystem::debug_draw(){
@@ -13,28 +419,51 @@ void PhysicsSystem::debug_draw(){
     static_dbvh.debug_draw();
 }
 
+/*
+ * Empty objects form a free list linked through next_empty.
+ * Returns null_object if there are no empty objects and the list is full.
+ */
 ObjectID PhysicsSystem::get_empty_dynamic() {
-    for(ObjectID i = empty_dynamic_start; i < dynamic_objects.size(); ++i){
-        if(dynamic_objects[i].empty())
-            return i;
+    if(empty_dynamic_head != null_object){
+        ObjectID oid = empty_dynamic_head;
+        empty_dynamic_head = dynamic_objects[oid].next_empty;
+        dynamic_objects[oid].next_empty = null_object;
+        return oid;
     }
+    if(dynamic_objects.size() >= MAX_DYNAMIC_OBJECTS)
+        return null_object;
     dynamic_objects.push_back(DynamicObject());
     return dynamic_objects.size()-1;
 }
 
 ObjectID PhysicsSystem::get_empty_static() {
-    for(ObjectID i = empty_static_start; i < static_objects.size(); ++i){
-        if(static_objects[i].empty())
-            return i;
+    if(empty_static_head != null_object){
+        ObjectID oid = empty_static_head;
+        empty_static_head = static_objects[oid].next_empty;
+        static_objects[oid].next_empty = null_object;
+        return oid;
     }
+    if(static_objects.size() >= MAX_STATIC_OBJECTS)
+        return null_object;
     static_objects.push_back(StaticObject());
     return static_objects.size()-1;
 }
 
+void PhysicsSystem::free_dynamic(ObjectID oid){
+    dynamic_objects[oid].clear();
+    dynamic_objects[oid].next_empty = empty_dynamic_head;
+    empty_dynamic_head = oid;
+}
+
+void PhysicsSystem::free_static(ObjectID oid){
+    static_objects[oid].clear();
+    static_objects[oid].next_empty = empty_static_head;
+    empty_static_head = oid;
+}
 
 ObjectID PhysicsSystem::create_object(const DynamicObject &d){
     //  Return if d does not have a collision shape
-    if(dynamic_objects.size() >= MAX_DYNAMIC_OBJECTS || d.shape == nullptr)
+    if(d.shape == nullptr)
         return null_object;
 
     // Get the next empty dynamic object, return if none found
@@ -43,10 +472,14 @@ ObjectID PhysicsSystem::create_object(const DynamicObject &d){
         return null_object;
 
 
-    // Create a new DBVH node, if not possible it will return null_node
-    NodeID nid = dynamic_dbvh.insert(d.shape->aabb, oid);
-    if(nid == null_node)
+    // Create a new DBVH node with an enlarged box, if not possible it will return null_node
+    AABB fat = d.shape->aabb;
+    fat.expand(DBVH_FAT_MARGIN);
+    NodeID nid = dynamic_dbvh.insert(fat, oid);
+    if(nid == null_node){
+        free_dynamic(oid);
         return null_object;
+    }
 
     // Copy the values of d into the new object
     dynamic_objects[oid] = d;
@@ -58,7 +491,7 @@ ObjectID PhysicsSystem::create_object(const DynamicObject &d){
 
 ObjectID PhysicsSystem::create_object(const StaticObject &s){
     //  Return if s does not have a collision shape
-    if(static_objects.size() >= MAX_STATIC_OBJECTS || s.shape == nullptr)
+    if(s.shape == nullptr)
         return null_object;
 
     // Get the next empty dynamic object, return if none found
@@ -68,40 +501,89 @@ ObjectID PhysicsSystem::create_object(const StaticObject &s){
 
     // Create a new DBVH node, if not possible it will return null_node
     NodeID nid = static_dbvh.insert(s.shape->aabb, oid);
-    if(nid == null_node)
+    if(nid == null_node){
+        free_static(oid);
         return null_object;
+    }
 
     // Copy the values of s into the new object
     static_objects[oid] = s;
 
     // Set the node for the dynamic object and return the new object id (no longer empty)
     static_objects[oid].dbvh_node = nid;
+    ++static_changes;
     return oid;
 }
 
-void PhysicsSystem::remove_dynamic_object(ObjectID oid){
-    // Return if out of bounds
-    if(oid == null_object || oid >= dynamic_objects.size())
+void PhysicsSystem::create_objects(const StaticObject *s, uint32_t count, ObjectID *return_ids){
+    ObjectID oid;
+    for(uint32_t i = 0; i < count; ++i){
+        oid = null_object;
+
+        // Objects are skipped if there is no space or no collision shape
+        if(s[i].shape != nullptr)
+            oid = get_empty_static();
+        if(oid != null_object){
+            static_objects[oid] = s[i];
+            // Mark as non-empty until the tree is built
+            static_objects[oid].dbvh_node = 0;
+        }
+
+        if(return_ids)
+            return_ids[i] = oid;
+    }
+
+    // Build the static tree from every static object
+    std::vector<AABB> aabbs;
+    std::vector<ObjectID> oids;
+    aabbs.reserve(static_objects.size());
+    oids.reserve(static_objects.size());
+    for(ObjectID i = 0; i < static_objects.size(); ++i){
+        if(static_objects[i].empty())
+            continue;
+        aabbs.push_back(static_objects[i].shape->aabb);
+        oids.push_back(i);
+    }
+
+    std::vector<NodeID> nids(oids.size());
+    static_dbvh.build(aabbs.data(), oids.data(), oids.size(), nids.data());
+    for(uint32_t i = 0; i < oids.size(); ++i){
+        static_objects[oids[i]].dbvh_node = nids[i];
+    }
+    static_changes = 0;
+}
+
+void PhysicsSystem::move_dynamic_object(ObjectID oid, vec3 displacement){
+    if(oid == null_object || oid >= dynamic_objects.size() || dynamic_objects[oid].empty())
         return;
 
-    // Clear the object
-    dynamic_objects[oid].clear();
+    // The tree is only changed if the shape left its enlarged box
+    DynamicObject &d = dynamic_objects[oid];
+    wake_island(oid);
+    d.shape->updateAABB();
+    dynamic_dbvh.move(d.dbvh_node, d.shape->aabb, displacement);
+}
 
-    // Update the empty start search location
-    if(empty_dynamic_start > oid)
-        empty_dynamic_start = oid;
+void PhysicsSystem::remove_dynamic_object(ObjectID oid){
+    // Return if out of bounds or already removed
+    if(oid == null_object || oid >= dynamic_objects.size() || dynamic_objects[oid].empty())
+        return;
+
+    // Remove the pairs and tree node, clear the object and add it to the free list
+    remove_pairs(oid, false);
+    dynamic_dbvh.remove(dynamic_objects[oid].dbvh_node);
+    free_dynamic(oid);
 }
 
 void PhysicsSystem::remove_static_object(ObjectID oid){
-// Return if out of bounds
-    if(oid == null_object || oid >= static_objects.size())
+    // Return if out of bounds or already removed
+    if(oid == null_object || oid >= static_objects.size() || static_objects[oid].empty())
         return;
 
-    // Clear the object
-    static_objects[oid].clear();
-
-    // Update the empty start search location
-    if(empty_static_start > oid)
-        empty_static_start = oid;
+    // Remove the pairs and tree node, clear the object and add it to the free list
+    remove_pairs(oid, true);
+    static_dbvh.remove(static_objects[oid].dbvh_node);
+    free_static(oid);
+    ++static_changes;
 }
 
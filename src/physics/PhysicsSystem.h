@@ -3,11 +3,23 @@
 
 #include "PhysicsTypes.h"
 #include "CollisionShape.h"
+#include "GJK.h"
 #include "DBVH.h"
+#include "WorkerPool.h"
+#include "Fixed.h"
+#include "definitions.h"
+#include <unordered_map>
 
 using std::vector;
 static constexpr uint8_t MAX_CONTACTS = 4;
+static constexpr uint8_t null_contact = UINT8_MAX;
+static constexpr uint32_t MAX_PAIR_CANDIDATES = 128; // Initial broadphase candidates per object per step, the buffer grows when filled
+static constexpr uint32_t NARROWPHASE_JOB_SIZE = 32;  // Pairs tested by each narrowphase job
 static constexpr uint32_t MAX_DYNAMIC_OBJECTS = 1000, MAX_STATIC_OBJECTS = 4000;
+static constexpr uint32_t STATIC_REBUILD_CHANGES = 256; // Static tree changes before a background rebuild is started
+static constexpr float SLEEP_VELOCITY = 0.005f;  // Motion per step under which an object is considered still
+static constexpr uint8_t SLEEP_STEPS = 20;      // Steps an entire island must be still before it sleeps
+static constexpr float CCD_MOTION_FRACTION = .5f;  // Objects moving further than this fraction of their smallest dimension per step are swept
 
 /*
  * Foundation class for other physics object classes.
@@ -17,6 +29,7 @@ public:
     NodeID dbvh_node = null_node;
     CollisionShape *shape = nullptr;
     EntityID owner = null_entity;
+    ObjectID next_empty = null_object;  // The next empty object when this object is empty
 
     inline bool empty(){
         return dbvh_node == null_node || shape == nullptr;
@@ -37,10 +50,69 @@ class StaticObject : public PhysicalObject{
 
 /*
  * An object that can move and be pushed.
+ * Sleeping objects are not moved or tested until woken by a contact or PhysicsSystem::wake_object,
+ * so logic should wake an object before changing its velocity.
  */
 class DynamicObject : public PhysicalObject{
 public:
-    ObjectID contacts[MAX_CONTACTS];
+    vec3 velocity = GLM_VEC3_ZERO_INIT; // Motion applied to the shape each step
+    bool awake = true;
+    uint8_t still_steps = 0;    // Consecutive steps with motion under SLEEP_VELOCITY
+    ObjectID island = null_object, next_in_island = null_object;    // Sleeping island head and list of its members
+    vec3 correction = GLM_VEC3_ZERO_INIT;   // Accumulated narrowphase corrections, applied after all pairs are tested
+    float toi = 1;  // Fraction of velocity applied by the current step, less than 1 after a swept contact
+    ObjectID contacts[MAX_CONTACTS] = {null_object, null_object, null_object, null_object};
+    bool contact_static[MAX_CONTACTS] = {};    // If the contact at the same index is a static object
+
+    // Add a contact to the first free slot, returns null_contact if full
+    inline uint8_t add_contact(ObjectID oid, bool is_static){
+        for(uint8_t i = 0; i < MAX_CONTACTS; ++i){
+            if(contacts[i] == null_object){
+                contacts[i] = oid;
+                contact_static[i] = is_static;
+                return i;
+            }
+        }
+        return null_contact;
+    }
+
+    inline void remove_contact(uint8_t slot){
+        if(slot < MAX_CONTACTS)
+            contacts[slot] = null_object;
+    }
+};
+
+/*
+ * A broadphase pair that persists while the fat AABBs of both objects overlap.
+ * a is always dynamic, b is a dynamic object with a greater id or a static object.
+ */
+struct ContactPair {
+    ObjectID a = null_object, b = null_object;
+    bool b_static = false;
+    bool touching = false;      // The pair has an established contact
+    bool colliding = false;     // The narrowphase result of the current step
+    uint8_t contact_a = null_contact, contact_b = null_contact; // Slots in the contacts arrays
+    uint32_t step = 0;          // The last step the pair was found by the broadphase
+    vec3 resolve = GLM_VEC3_ZERO_INIT;  // Penetration vector from EPA, a moves by -resolve
+    GJKCache gjk_cache;         // Search direction of the last narrowphase, seeds the next one
+};
+
+/*
+ * Narrowphase output of a worker, pair is the index in the active pair list
+ */
+struct NarrowphaseResult {
+    uint32_t pair;
+    bool colliding;
+    vec3 resolve;
+};
+
+/*
+ * Created/removed contact, contact_b is null_contact for static objects
+ */
+struct ContactEvent {
+    EntityID a, b;
+    bool added;
+    uint8_t contact_a, contact_b;
 };
 
 /*
@@ -51,6 +123,7 @@ public:
  *    Entity data compaction is bidirectional, the entities change indices and then update the indicies of the respective physics object.
  *    DBVH data does not get compacted
  * 2. Object applies any motion or transformations, this is only for Dynamic Objects, if none/negligible, the object is marked as asleep
+ *    Objects moving further than their size are swept against both trees first and stop at their first contact
  * 3. Object calculates collisions with other object and calculates state (self correction and contacts), but do not apply them
  * 4. Apply any physics corrections
  * 5. Apply created/destroyed contact logic
@@ -84,17 +157,58 @@ class PhysicsSystem {
     vector<DynamicObject> dynamic_objects;
     vector<StaticObject> static_objects;
 
+    // The first empty object of each list
     ObjectID
-        empty_dynamic_start = 0,
-        empty_static_start = 0;
+        empty_dynamic_head = null_object,
+        empty_static_head = null_object;
+
+    // Number of static tree insertions/removals since the last build
+    uint32_t static_changes = 0;
+
+    // Overlapping pairs, keyed by pair_key, and the pairs found by the current step
+    std::unordered_map<uint64_t, ContactPair> pairs;
+    vector<ContactPair*> active_pairs;
+    vector<uint64_t> ended_pairs;       // Keys of pairs to remove, sorted so events do not follow the hash order
+    vector<ObjectID> pair_candidates = vector<ObjectID>(MAX_PAIR_CANDIDATES);   // Scratch broadphase results
+    vector<ContactEvent> contact_events;
+    vector<ObjectID> island_parent;     // Union-find over touching awake objects
+    uint32_t step = 0;
+
+    // Narrowphase jobs are split across the pool, each worker writes to its own buffer
+    WorkerPool workers;
+    vector<NarrowphaseResult> worker_contacts[MAX_WORKERS];
+
+    static inline uint64_t pair_key(ObjectID a, ObjectID b, bool b_static){
+        return ((uint64_t)a << 33) | ((uint64_t)b_static << 32) | b;
+    }
 
     ObjectID get_empty_dynamic();
     ObjectID get_empty_static();
+    void free_dynamic(ObjectID oid);
+    void free_static(ObjectID oid);
+    void update_static_nodes();
     void clear_dynamic();
     void clear_static();
 
+    // Update steps, in order
+    void integrate();
+    float time_of_impact(ObjectID oid);
+    void find_pairs();
+    void add_pair(ObjectID a, ObjectID b, bool b_static);
+    void narrowphase();
+    void apply_corrections();
+    void snap_state();
+    void update_contacts();
+    void update_islands();
+    ObjectID find_island(ObjectID oid);
+    void wake_island(ObjectID oid);
+    void end_contact(ContactPair &p);
+    void remove_pairs(ObjectID oid, bool is_static);
+    void end_pairs();
+
 public:
-    void init();
+    // Start the narrowphase workers, 0 uses the hardware thread count
+    void init(uint32_t worker_count = 0);
     void update();
     void debug_draw();
 
@@ -102,10 +216,36 @@ public:
     ObjectID create_object(const DynamicObject &d);
     ObjectID create_object(const StaticObject &s);
 
+    // Create many static objects at once and build the static tree in a single pass, return_ids is optional
+    void create_objects(const StaticObject *s, uint32_t count, ObjectID *return_ids = nullptr);
+
+    // Update the broadphase after a dynamic object's shape was moved, displacement is the motion over the step
+    void move_dynamic_object(ObjectID oid, vec3 displacement);
+
     // Remove an object by its id
     void remove_dynamic_object(ObjectID oid);
     void remove_static_object(ObjectID oid);
 
+    // Wake a sleeping object and every object in its island
+    void wake_object(ObjectID oid);
+
+    // Closest static or dynamic object hit by the ray origin + dir*t, max_t is set to the distance of the hit
+    // Returns the owner of the object, or null_entity on a miss
+    EntityID raycast(const vec3 origin, const vec3 dir, float &max_t);
+
+    // Trees published by the last update, safe to query from any thread
+    inline std::shared_ptr<const DBVHSnapshot> get_dynamic_snapshot() const {
+        return dynamic_dbvh.get_snapshot();
+    }
+    inline std::shared_ptr<const DBVHSnapshot> get_static_snapshot() const {
+        return static_dbvh.get_snapshot();
+    }
+
+    // Contacts created/removed by the last update
+    inline const vector<ContactEvent>& get_contact_events(){
+        return contact_events;
+    }
+
     // Get an object
     inline StaticObject* get_static_object(ObjectID oid){
         if(oid == null_node)
@@ -0,0 +1,76 @@
+#include "WorkerPool.h"
+
+WorkerPool::~WorkerPool(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for(std::thread &t : threads)
+        t.join();
+}
+
+void WorkerPool::init(uint32_t count){
+    if(!threads.empty())
+        return;
+    if(count == 0)
+        count = std::thread::hardware_concurrency();
+    count = std::max(1u, std::min(count, MAX_WORKERS));
+
+    threads.reserve(count-1);
+    for(uint32_t i = 1; i < count; ++i)
+        threads.emplace_back(&WorkerPool::work, this, i);
+}
+
+void WorkerPool::take_jobs(uint32_t worker){
+    uint32_t job;
+    while((job = next_job.fetch_add(1)) < job_count)
+        batch_func(job, worker);
+}
+
+void WorkerPool::work(uint32_t worker){
+    uint32_t last_batch = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+        start_cv.wait(lock, [&]{ return stopping || batch != last_batch; });
+        if(stopping)
+            return;
+        last_batch = batch;
+        ++busy_workers;
+
+        lock.unlock();
+        take_jobs(worker);
+        lock.lock();
+
+        if(--busy_workers == 0)
+            done_cv.notify_all();
+    }
+}
+
+void WorkerPool::run(uint32_t count, const std::function<void(uint32_t job, uint32_t worker)> &func){
+    if(count == 0)
+        return;
+
+    // Small batches are not worth waking the threads
+    if(threads.empty() || count == 1){
+        for(uint32_t i = 0; i < count; ++i)
+            func(i, 0);
+        return;
+    }
+
+    // A worker that woke late for the last batch may still be looking for jobs
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&]{ return busy_workers == 0; });
+    batch_func = func;
+    job_count = count;
+    next_job = 0;
+    ++batch;
+    lock.unlock();
+    start_cv.notify_all();
+
+    take_jobs(0);
+
+    // Wait for the workers still running a job
+    lock.lock();
+    done_cv.wait(lock, [&]{ return busy_workers == 0; });
+}
@@ -0,0 +1,49 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <inttypes.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+static constexpr uint32_t MAX_WORKERS = 8;
+
+/*
+ * A fixed set of threads that run batches of independent jobs.
+ * The calling thread works as worker 0, so a pool of 1 runs everything inline.
+ * NOTE run() is not reentrant and must only be called from one thread
+ */
+class WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+
+    // The current batch, jobs are taken in order from next_job
+    std::function<void(uint32_t job, uint32_t worker)> batch_func;
+    std::atomic<uint32_t> next_job = 0;
+    uint32_t job_count = 0;
+    uint32_t batch = 0;         // Incremented for each batch to wake the workers
+    uint32_t busy_workers = 0;
+    bool stopping = false;
+
+    void work(uint32_t worker);
+    void take_jobs(uint32_t worker);
+
+public:
+    ~WorkerPool();
+
+    // Start count-1 threads, 0 uses the hardware thread count
+    void init(uint32_t count = 0);
+
+    // Run func for every job in [0, job_count) and wait for all of them to finish
+    void run(uint32_t job_count, const std::function<void(uint32_t job, uint32_t worker)> &func);
+
+    inline uint32_t size(){
+        return threads.size() + 1;
+    }
+};
+
+#endif // WORKERPOOL_H
@@ -1,6 +1,7 @@
 #include "Plant.h"
 #include "Shader.h"
 #include <queue>
+#include "Profiler.h"
 
 
 uint8_t SpeciesList::add(Terrain &terrain, float water_level){
@@ -58,6 +59,30 @@ void SpeciesList::draw(View &view){
     }
 };
 
+PlantID SpeciesList::raycast(const vec3 origin, const vec3 dir, float &max_t){
+    PlantID hit = PLANT_NULL;
+    uint16_t instance;
+    // Each species shortens max_t, later species only report closer hits
+    for(uint8_t i = 0; i < list.size(); ++i){
+        instance = list[i].raycast(origin, dir, max_t);
+        if(instance != PLANT_NULL)
+            hit = (i << PLANT_INSTANCE_BITS) | instance;
+    }
+    return hit;
+}
+
+PlantID SpeciesList::get_closest(const vec3 pos, float &max_dist){
+    PlantID closest = PLANT_NULL;
+    uint16_t instance;
+    // Each species shortens max_dist, so later species stop early when they can not be closer
+    for(uint8_t i = 0; i < list.size(); ++i){
+        instance = list[i].get_closest(pos, max_dist);
+        if(instance != PLANT_NULL)
+            closest = (i << PLANT_INSTANCE_BITS) | instance;
+    }
+    return closest;
+}
+
 // Plant System
 
 void PlantSystem::init(Terrain &terrain, float water_level){
@@ -66,6 +91,7 @@ void PlantSystem::init(Terrain &terrain, float water_level){
 }
 
 void PlantSystem::update(Terrain &terrain, float water_level){
+    PROFILE_ZONE("PlantSystem::update");
     if(update_cycle >= 64){
         species.update(terrain, water_level);
     }
@@ -76,14 +102,17 @@ void PlantSystem::draw(View &view){
     species.draw(view);
 }
 
-// TODO this is not efficient, just a test
-PlantID PlantSystem::get_closest_plant(vec3 pos){
+PlantID PlantSystem::get_closest_plant(vec3 pos, float max_dist){
+    return species.get_closest(pos, max_dist);
 }
 
 PlantInstance* PlantSystem::get_plant(uint32_t plant_id){
     if(plant_id == PLANT_NULL)
         return nullptr;
 
-    return nullptr;
+    PlantSpecies *s = species.at(plant_id >> PLANT_INSTANCE_BITS);
+    if(!s)
+        return nullptr;
+    return s->get_instance(plant_id & PLANT_INSTANCE_MASK);
 }
 
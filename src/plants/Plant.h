@@ -23,6 +23,8 @@ public:
     PlantSpecies* at(uint8_t id);
     void update(Terrain &terrain, float water_level);
     void draw(View &view);
+    PlantID raycast(const vec3 origin, const vec3 dir, float &max_t);
+    PlantID get_closest(const vec3 pos, float &max_dist);
 };
 
 /*
@@ -38,7 +40,14 @@ public:
     void init(Terrain &terrain, float water_level);
     void update(Terrain &terrain, float water_level);
     void draw(View &view);
-    PlantID get_closest_plant(vec3 pos);
+
+    // Nearest plant of any species within max_dist, returns PLANT_NULL if there is none
+    PlantID get_closest_plant(vec3 pos, float max_dist = INFINITY);
+
+    // Closest plant whose bounding box is hit by the ray origin + dir*t, returns PLANT_NULL on a miss
+    inline PlantID raycast(const vec3 origin, const vec3 dir, float &max_t){
+        return species.raycast(origin, dir, max_t);
+    }
     PlantInstance* get_plant(uint32_t plant_id);
 };
 
@@ -3,6 +3,7 @@
 #include "Shader.h"
 #include <queue>
 #include <random>
+#include "Profiler.h"
 
 
 static inline float random_01( std::mt19937 &mt ) {
@@ -80,6 +81,8 @@ void PlantSpecies::init(Terrain &terrain, float water_level){
     PlantInstance p;
     std::mt19937 mt;
     AABB bb;
+    std::vector<AABB> boxes;
+    std::vector<ObjectID> oids;
     for(uint32_t i = 0; i < 100; ++i){
         p.pos[0] = 400.0f*random_n11(mt) + (TERRAIN_DIM*TERRAIN_SCALE*.5);
         p.pos[2] = 400.0f*random_n11(mt) + (TERRAIN_DIM*TERRAIN_SCALE*.5);
@@ -89,25 +92,30 @@ void PlantSpecies::init(Terrain &terrain, float water_level){
             continue;
         }
         p.y_rot =  6.28f*random_01(mt);
+        p.is_empty = false;
         bb = bounding_box;
         bb.translate(p.pos);
-        dbvh.insert(bb, instances.size());
+        boxes.push_back(bb);
+        oids.push_back(instances.size());
         instances.push_back(p);
     }
+
+    // Build the tree from all instances at once
+    dbvh.build(boxes.data(), oids.data(), boxes.size());
+    dbvh.publish();
 }
 
 void PlantSpecies::draw(View &view){
     if(empty())
         return;
+    PROFILE_ZONE("PlantSpecies::draw");
     vao->bind();
     mat4 transform;
     versor v = GLM_QUAT_IDENTITY_INIT;
     vec3 up = {0,1,0};
     vec4 *frustum =  view.get_frustum_planes(.7);
-    int draw_count = 0, iterations = 0;
 
     // for(PlantInstance &p : instances){
-    //     iterations++;
     //     if(glm_vec3_distance(view.pos,p.pos)>VIEW_FAR*.2)
     //         continue;
     //     if(!bounding_box.in_frustum(frustum, p.pos))
@@ -122,34 +130,19 @@ void PlantSpecies::draw(View &view){
     // }
 
 
-    static NodeQueue nq;
-    nq.clear();
-    nq.push(dbvh.get_root());
-    Node *n;
-    while( !nq.empty()){
-        iterations++;
-        n = dbvh.at(nq.front());
-        nq.pop();
-        if(n && n->aabb.in_frustum(frustum)){
-            if(n->isLeaf()){
-                PlantInstance &p = instances[n->oid];
-                draw_count++;
-                // n->aabb.debug_draw();
-                // DebugDraw::axis(v, p.pos);
-                glm_rotate_make(transform, p.y_rot, up);
-                glm_vec3_copy(p.pos, transform[3]);
-                Shader::uniformMat4f(UNIFORM_TRANSFORM, transform);
-                glDrawElements( GL_TRIANGLES, vao->getIndexCount(), GL_UNSIGNED_INT, 0 );
-            }
-            else if(n->hasChildren()){
-                nq.push(n->child1);
-                nq.push(n->child2);
-            }
-        }
-    }
+    // Query the visible instances from the DBVH, then draw them
+    static ObjectID visible[PLANT_MAX_INSTANCES];
+    unsigned int visible_count = 0;
+    dbvh.get_in_frustum(frustum, visible, visible_count, PLANT_MAX_INSTANCES);
 
-    printf("dc:%d it:%d\n",draw_count,iterations);
-    fflush(stdout);
+    for(unsigned int i = 0; i < visible_count; ++i){
+        PlantInstance &p = instances[visible[i]];
+        // DebugDraw::axis(v, p.pos);
+        glm_rotate_make(transform, p.y_rot, up);
+        glm_vec3_copy(p.pos, transform[3]);
+        Shader::uniformMat4f(UNIFORM_TRANSFORM, transform);
+        glDrawElements( GL_TRIANGLES, vao->getIndexCount(), GL_UNSIGNED_INT, 0 );
+    }
 }
 
 void PlantSpecies::update(Terrain &terrain, float water_level){
@@ -165,3 +158,28 @@ void PlantSpecies::clear() {
     mesh.clear();
     vao->free();
 }
+
+uint16_t PlantSpecies::raycast(const vec3 origin, const vec3 dir, float &max_t){
+    if(empty())
+        return PLANT_NULL;
+    ObjectID oid = dbvh.raycast(origin, dir, max_t);
+    return oid == null_object ? PLANT_NULL : oid;
+}
+
+uint16_t PlantSpecies::get_closest(const vec3 pos, float &max_dist){
+    if(empty())
+        return PLANT_NULL;
+
+    // The base of an instance is within its box, so the box distance is a lower bound
+    ObjectID oid;
+    unsigned int count = dbvh.get_nearest(pos, 1, &oid, &max_dist, max_dist, [&](ObjectID i, float){
+        return glm_vec3_distance(instances[i].pos, (float*)pos);
+    });
+    return count ? oid : PLANT_NULL;
+}
+
+PlantInstance* PlantSpecies::get_instance(uint16_t instance){
+    if(instance >= instances.size() || instances[instance].is_empty)
+        return nullptr;
+    return &instances[instance];
+}
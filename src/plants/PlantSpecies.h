@@ -57,6 +57,13 @@ public:
     void update(Terrain &terrain, float water_level);
     void clear();
     inline bool empty(){return is_empty;}
+
+    // Instance nearest to pos within max_dist, max_dist is set to its distance, returns PLANT_NULL if there is none
+    uint16_t get_closest(const vec3 pos, float &max_dist);
+    PlantInstance* get_instance(uint16_t instance);
+
+    // Closest instance whose bounding box is hit by the ray origin + dir*t, returns PLANT_NULL on a miss
+    uint16_t raycast(const vec3 origin, const vec3 dir, float &max_t);
 };
 
 #endif // PLANTSPECIES_H
@@ -0,0 +1,86 @@
+#include "Profiler.h"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace Profiler {
+    std::atomic<bool> enabled = false;
+}
+
+// Buffers are kept after their thread exits so its zones can still be exported
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<ProfileBuffer>> buffers;
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+static thread_local ProfileBuffer *thread_buffer = nullptr;
+
+// The calling thread's buffer, registered on first use
+static ProfileBuffer *get_buffer(){
+    if(thread_buffer)
+        return thread_buffer;
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers.push_back(std::make_unique<ProfileBuffer>());
+    thread_buffer = buffers.back().get();
+    thread_buffer->thread_id = buffers.size() - 1;
+    snprintf(thread_buffer->thread_name, sizeof(thread_buffer->thread_name), "Thread %u", thread_buffer->thread_id);
+    return thread_buffer;
+}
+
+uint64_t Profiler::now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Profiler::record(const char *name, uint64_t start, uint64_t end){
+    ProfileBuffer *b = get_buffer();
+    uint64_t head = b->head.load(std::memory_order_relaxed);
+    ProfileEvent &e = b->events[head % PROFILER_BUFFER_EVENTS];
+    e.name = name;
+    e.start = start;
+    e.duration = end - start;
+    b->head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::set_thread_name(const char *name){
+    ProfileBuffer *b = get_buffer();
+    snprintf(b->thread_name, sizeof(b->thread_name), "%s", name);
+}
+
+bool Profiler::export_trace(const char *path){
+    FILE *file = fopen(path, "w");
+    if(!file)
+        return false;
+
+    std::vector<ProfileEvent> events;
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    fputs("{\"traceEvents\":[\n", file);
+    bool first = true;
+    for(std::unique_ptr<ProfileBuffer> &b : buffers){
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", b->thread_id, b->thread_name);
+        first = false;
+
+        // Copy the newest events, then drop any the writer may have overwritten during the copy
+        uint64_t head = b->head.load(std::memory_order_acquire);
+        uint64_t tail = head > PROFILER_BUFFER_EVENTS ? head - PROFILER_BUFFER_EVENTS : 0;
+        events.clear();
+        for(uint64_t i = tail; i < head; ++i)
+            events.push_back(b->events[i % PROFILER_BUFFER_EVENTS]);
+        // The writer may be rewriting slot new_head, which holds event new_head - PROFILER_BUFFER_EVENTS, so that one is dropped too
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t new_head = b->head.load(std::memory_order_relaxed);
+        uint64_t overwritten = new_head + 1 > PROFILER_BUFFER_EVENTS ? new_head + 1 - PROFILER_BUFFER_EVENTS : 0;
+        uint64_t skip = overwritten > tail ? std::min<uint64_t>(overwritten - tail, events.size()) : 0;
+
+        // Times are written in microseconds
+        for(uint64_t i = skip; i < events.size(); ++i){
+            ProfileEvent &e = events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    e.name, b->thread_id, e.start / 1000.0, e.duration / 1000.0);
+        }
+    }
+    fputs("\n]}\n", file);
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <inttypes.h>
+#include <atomic>
+#include <chrono>
+#include "definitions.h"
+
+/*
+ * A finished zone, times are in nanoseconds since the profiler started
+ */
+struct ProfileEvent {
+    const char *name;   // Must be a string literal, only the pointer is stored
+    uint64_t start;
+    uint64_t duration;
+};
+
+/*
+ * Ring buffer of one thread's zones, only the owning thread writes to it.
+ * The oldest events are overwritten when it is full. The head is published after each event,
+ * so a reader can copy the buffer without a lock and drop any event written over while it copied.
+ */
+struct ProfileBuffer {
+    ProfileEvent events[PROFILER_BUFFER_EVENTS];
+    std::atomic<uint64_t> head = 0;     // Total events written, the next slot is head % PROFILER_BUFFER_EVENTS
+    uint32_t thread_id = 0;
+    char thread_name[32] = {};
+};
+
+/*
+ * Scoped zone profiler, zones are exported as a Chrome trace (chrome://tracing or ui.perfetto.dev).
+ * Recording is off until enabled, a disabled zone only loads one flag.
+ * Setting PROFILER_ZONES to false in definitions.h removes the zones entirely.
+ */
+namespace Profiler {
+    extern std::atomic<bool> enabled;
+
+    // Nanoseconds since the profiler started
+    uint64_t now();
+
+    // Record a finished zone on the calling thread's buffer
+    void record(const char *name, uint64_t start, uint64_t end);
+
+    // Name the calling thread in the trace
+    void set_thread_name(const char *name);
+
+    // Write every buffered zone of every thread as Chrome trace JSON, returns false if the file could not be written
+    // Safe to call while other threads record
+    bool export_trace(const char *path);
+
+    inline bool is_enabled(){
+        return enabled.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Records the time from construction to the end of the scope
+ */
+class ProfileZone {
+    const char *name;
+    uint64_t start = 0;
+
+public:
+    inline ProfileZone(const char *name) : name(name) {
+        if(Profiler::is_enabled())
+            start = Profiler::now() + 1;
+    }
+    inline ~ProfileZone(){
+        // 0 marks a zone that started while disabled
+        if(start != 0)
+            Profiler::record(name, start - 1, Profiler::now());
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#if PROFILER_ZONES
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+#endif // PROFILER_H
@@ -1,6 +1,9 @@
 #include "Player.h"
 #include "Packet.h"
 #include "Mesh.h"
+#include "Collide.h"
+#include "Fixed.h"
+#include "Profiler.h"
 
 VAO player_vao;
 Mesh player_mesh;
@@ -106,6 +109,7 @@ uint8_t PlayerSet::login( std::string username, std::string passkey, ServerConne
         // Passkey matches
         if(player_saves[save_id].passkey == passkey){
             players[player_count] = player_saves[save_id];
+            players[player_count].reset_connection();
             peer->data = &players[player_count];
             peers[player_count] = peer;
             ++player_count;
@@ -125,6 +129,7 @@ uint8_t PlayerSet::login( std::string username, std::string passkey, ServerConne
         // Save made
         if(save_id != MAX_PLAYER_SAVES){
             players[player_count] = player_saves[save_id];
+            players[player_count].reset_connection();
             peers[player_count] = peer;
             peer->data = &players[player_count];
             ++player_count;
@@ -168,9 +173,11 @@ void PlayerSet::logout(ServerConnection *connection, ENetPeer *peer){
 
             // Shift players to replace the removed player
             enet_peer_reset(peers[i]);
+            // Peers move with their players, so snapshots and input still reach the right slot
             for(uint8_t j = i; j < player_count - 1; ++j){
                 players[j] = players[j+1];
-                peers[j]->data = peers[j+1]->data;
+                peers[j] = peers[j+1];
+                peers[j]->data = &players[j];
             }
             // Decrement the player count and clear the unsused player
             --player_count;
@@ -194,6 +201,48 @@ void PlayerSet::clear() {
         peers[i] = nullptr;
     }
     player_count = 0;
+    snapshots.clear();
+    snapshot_id = 0;
+    acked_input = 0;
+    inputs = InputHistory();
+    input_sequence = 0;
+}
+
+void PlayerSet::take_snapshot( Snapshot &s ){
+    s.count = player_count;
+    for( uint8_t i = 0; i < player_count; ++i ){
+        Player &p = players[i];
+        PlayerSnapshot &q = s.players[i];
+        q.move_mode = p.move_mode;
+        q.input_flag = p.input_flag;
+        for( unsigned int a = 0; a < 3; ++a ){
+            q.pos[a] = Quantize::position( p.collision_shape.pos[a], a );
+            q.velocity[a] = Quantize::velocity( p.velocity[a] );
+        }
+        q.rot = Quantize::rotation( p.collision_shape.rot );
+        q.look_rot = Quantize::rotation( p.look_rot );
+    }
+}
+
+void PlayerSet::apply_snapshot( const Snapshot &s ){
+    reserve( s.count );
+    for( uint8_t i = 0; i < player_count; ++i ){
+        Player &p = players[i];
+        const PlayerSnapshot &q = s.players[i];
+
+        // Active Player (write fewer predicted or known states)
+        if( i != active_player_slot ){
+            p.input_flag = q.input_flag;
+            Quantize::rotation( q.look_rot, p.look_rot );
+        }
+        p.move_mode = (Player::MotionMode)q.move_mode;
+        for( unsigned int a = 0; a < 3; ++a ){
+            p.collision_shape.pos[a] = Quantize::position( q.pos[a], a );
+            p.velocity[a] = Quantize::velocity( q.velocity[a] );
+        }
+        Quantize::rotation( q.rot, p.collision_shape.rot );
+        glm_quat_inv( p.collision_shape.rot, p.collision_shape.inv_rot );
+    }
 }
 
 void PlayerSet::kick_all(){
@@ -203,11 +252,87 @@ void PlayerSet::kick_all(){
     }
 }
 
+void PlayerSet::reconcile( Terrain *terrain, float water_level ){
+    PROFILE_ZONE("PlayerSet::reconcile");
+    Player *p = get_active();
+    if( !p )
+        return;
+
+    // The snapshot holds the state after the acknowledged input, inputs the server has not applied are run again from it
+    uint16_t input_flag = p->input_flag;
+    versor look_rot;
+    glm_quat_copy( p->look_rot, look_rot );
+    const PlayerInput *in;
+    uint32_t first = acked_input + 1;
+    if( input_sequence >= INPUT_HISTORY )
+        first = std::max<uint32_t>( first, input_sequence - INPUT_HISTORY + 1 );
+    for( uint32_t s = first; s <= input_sequence; ++s ){
+        if( !( in = inputs.get( s ) ) )
+            continue;
+        p->input_flag = in->input_flag;
+        Quantize::rotation( in->look_rot, p->look_rot );
+        p->predict_step( terrain, water_level );
+    }
+
+    // Keep the current controls, they may have changed since the last recorded input
+    p->input_flag = input_flag;
+    glm_quat_copy( look_rot, p->look_rot );
+}
+
+void PlayerSet::record_input(){
+    Player *p = get_active();
+    if( !p )
+        return;
+    PlayerInput &in = inputs.add( ++input_sequence );
+    in.input_flag = p->input_flag;
+    in.look_rot = Quantize::rotation( p->look_rot );
+}
+
+void Player::reset_connection(){
+    acked_snapshot = 0;
+    inputs = InputHistory();
+    input_sequence = 0;
+    received_input = 0;
+}
+
+void Player::predict_step( Terrain *terrain, float water_level ){
+    // Same order as Scene::update, collisions with other players are left to the next snapshot
+    update_motion();
+    update_terrain_collision( terrain );
+    apply_bouyant_force( water_level );
+    if( PHYSICS_DETERMINISTIC )
+        snap_state();
+}
+
+void PlayerSet::apply_inputs(){
+    PROFILE_ZONE("PlayerSet::apply_inputs");
+    const PlayerInput *in;
+    uint32_t next;
+    for( uint8_t i = 0; i < player_count; ++i ){
+        Player &p = players[i];
+
+        // Inputs lost beyond the redundancy of the input packets, or too old to be kept, are skipped
+        next = p.input_sequence + 1;
+        if( p.received_input >= INPUT_HISTORY )
+            next = std::max<uint32_t>( next, p.received_input - INPUT_HISTORY + 1 );
+        in = nullptr;
+        for( ; next <= p.received_input && !( in = p.inputs.get( next ) ); ++next );
+
+        // Without a new input the player keeps the last one
+        if( !in )
+            continue;
+        p.input_flag = in->input_flag;
+        Quantize::rotation( in->look_rot, p.look_rot );
+        p.input_sequence = next;
+    }
+}
+
 void Player::update_logic() {
     // TODO player logic implementation goes here
 }
 
 void PlayerSet::update_logic() {
+    PROFILE_ZONE("PlayerSet::update_logic");
     // TODO update each player's logic
 }
 
@@ -297,6 +422,7 @@ void Player::update_motion(){
 }
 
 void PlayerSet::update_motion(){
+    PROFILE_ZONE("PlayerSet::update_motion");
     // Apply velocities
     for( uint8_t i = 0; i < player_count; ++i ) {
         players[i].update_motion();
@@ -304,56 +430,132 @@ void PlayerSet::update_motion(){
 }
 
 void PlayerSet::update_collision(){
-    //TODO replace with proper collision
-    for( unsigned int i = 0; i < player_count; ++i ) {
-        vec3 resolve = GLM_VEC3_ZERO_INIT;
-        vec3 down = {0,-1,0};
-        for( unsigned int j = 0; j < player_count; ++j ) {
-            if( i == j )
+    PROFILE_ZONE("PlayerSet::update_collision");
+    // Slots are compacted on logout and resized by synch packets, so the tree is rebuilt from the current slots
+    AABB boxes[MAX_PLAYERS];
+    ObjectID slots[MAX_PLAYERS];
+    for( uint8_t i = 0; i < player_count; ++i ) {
+        players[i].collision_shape.updateAABB();
+        boxes[i] = players[i].collision_shape.aabb;
+        slots[i] = i;
+    }
+    player_dbvh.build( boxes, slots, player_count );
+    player_dbvh.publish();
+
+    ObjectID candidates[MAX_PLAYERS];
+    unsigned int candidate_count;
+    vec3 resolve, down = {0,-1,0};
+    float d;
+    for( uint8_t i = 0; i < player_count; ++i ) {
+        player_dbvh.get_intersecting( boxes[i], candidates, candidate_count, MAX_PLAYERS );
+
+        // Positions change as pairs are resolved, so they are resolved in slot order rather than tree order
+        std::sort( candidates, candidates + candidate_count );
+        for( unsigned int c = 0; c < candidate_count; ++c ) {
+            // Each unordered pair is tested once, by the lesser slot
+            ObjectID j = candidates[c];
+            if( j <= i )
                 continue;
-            if( CollisionShape::gjk( players[i].collision_shape, players[j].collision_shape, resolve ) ) {
+            if( collide( players[i].collision_shape, players[j].collision_shape, resolve ) ) {
                 glm_vec3_scale(resolve,.5,resolve);
                 glm_vec3_sub(players[i].collision_shape.pos, resolve, players[i].collision_shape.pos );
                 glm_vec3_add(players[j].collision_shape.pos, resolve, players[j].collision_shape.pos );
+
+                // The player on top can walk
                 glm_vec3_normalize(resolve);
-                if(glm_vec3_dot(resolve,down) > .8)
+                d = glm_vec3_dot(resolve,down);
+                if(d > .8)
                     players[i].move_mode = Player::WALK;
+                else if(d < -.8)
+                    players[j].move_mode = Player::WALK;
             }
         }
     }
 }
 
-void PlayerSet::update_terrain_collision(Terrain *terrain){
-    // TODO this is only point collision, fix to account for gjk?
-    vec3 gpos;
-     for(unsigned int i = 0; i < player_count; ++i){
-        vec3 &pos = players[i].collision_shape.pos;
-        glm_vec3_copy(pos, gpos);
-        terrain->pointProjection(gpos);
-        gpos[1]+=1;
-
-        // Ease in if slightly above the surface
-        if(pos[1] <= gpos[1] + .2){
-            if(players[i].move_mode == Player::IN_AIR || players[i].move_mode == Player::SWIM)
-                players[i].move_mode = Player::WALK;
-            pos[1] = fmax(pos[1]-.1,gpos[1]);
+uint8_t PlayerSet::raycast( const vec3 origin, const vec3 dir, float &max_t, uint8_t ignore ){
+    float t;
+    ObjectID slot = player_dbvh.raycast( origin, dir, max_t, [&]( ObjectID i, float ) {
+        // Slots may have been removed since the tree was built
+        if( i == ignore || i >= player_count )
+            return -1.0f;
+        return ::raycast( players[i].collision_shape, origin, dir, max_t, t ) ? t : -1.0f;
+    } );
+    return slot == null_object ? MAX_PLAYERS : slot;
+}
+
+void Player::update_terrain_collision(Terrain *terrain){
+    vec3 start, resolve, probe = {0,-.2,0};
+    float t, d;
+    Capsule &shape = collision_shape;
+    vec3 &pos = shape.pos;
+
+    // Fast motion is swept from the start of the step so it stops at the surface instead of passing through
+    if(glm_vec3_norm2(velocity) > shape.radius*shape.radius){
+        glm_vec3_sub(pos, velocity, start);
+        glm_vec3_copy(start, pos);
+        if(terrain->sweep(shape, velocity, t)){
+            glm_vec3_muladds(velocity, t, pos);
+            if(velocity[1] < 0)
+                velocity[1] = 0;
         }
         else{
-            players[i].move_mode = Player::IN_AIR;
+            glm_vec3_add(pos, velocity, pos);
         }
     }
+
+    // Push out of the surface and remove any velocity going into it
+    if(terrain->collide(shape, resolve)){
+        glm_vec3_sub(pos, resolve, pos);
+        glm_vec3_normalize(resolve);
+        d = glm_vec3_dot(velocity, resolve);
+        if(d > 0)
+            glm_vec3_muladds(resolve, -d, velocity);
+    }
+
+    // Ease in if slightly above the surface
+    if(terrain->sweep(shape, probe, t)){
+        if(move_mode == IN_AIR || move_mode == SWIM)
+            move_mode = WALK;
+        pos[1] -= fminf(.1f, -probe[1]*t);
+    }
+    else{
+        move_mode = IN_AIR;
+    }
 }
 
-void PlayerSet::apply_bouyant_force(float water_level){
-    for(unsigned int i = 0; i < player_count; ++i){
-        if(players[i].collision_shape.pos[1] < water_level){
-            players[i].move_mode = Player::SWIM;
-            players[i].velocity[1] = .95* players[i].velocity[1] + .2*(water_level - players[i].collision_shape.pos[1]);
-        }
+void PlayerSet::update_terrain_collision(Terrain *terrain){
+    PROFILE_ZONE("PlayerSet::update_terrain_collision");
+    for(unsigned int i = 0; i < player_count; ++i)
+        players[i].update_terrain_collision(terrain);
+}
+
+void Player::apply_bouyant_force(float water_level){
+    if(collision_shape.pos[1] < water_level){
+        move_mode = SWIM;
+        velocity[1] = .95* velocity[1] + .2*(water_level - collision_shape.pos[1]);
     }
 }
 
+void PlayerSet::apply_bouyant_force(float water_level){
+    PROFILE_ZONE("PlayerSet::apply_bouyant_force");
+    for(unsigned int i = 0; i < player_count; ++i)
+        players[i].apply_bouyant_force(water_level);
+}
+
+void Player::snap_state(){
+    fixed_snap(collision_shape.pos);
+    fixed_snap(velocity);
+}
+
+void PlayerSet::snap_state(){
+    PROFILE_ZONE("PlayerSet::snap_state");
+    for(uint8_t i = 0; i < player_count; ++i)
+        players[i].snap_state();
+}
+
 void PlayerSet::update_armatures() {
+    PROFILE_ZONE("PlayerSet::update_armatures");
     for(uint8_t i = 0; i < player_count; ++i){
         // Play animations
 
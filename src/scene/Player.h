@@ -9,6 +9,39 @@
 #include "DBVH.h"
 #include "ServerConnection.h"
 #include "Terrain.h"
+#include "Snapshot.h"
+
+/*
+ * The controls of a player for one step, sequence 0 is never used so it can mark a missing input
+ */
+struct PlayerInput {
+    uint32_t sequence = 0;
+    uint16_t input_flag = 0;
+    uint32_t look_rot = 0;      // Quantized, see Quantize::rotation
+};
+
+/*
+ * The last INPUT_HISTORY inputs of a player, indexed by sequence.
+ * The client keeps the inputs it sent in its PlayerSet to predict them again after each snapshot,
+ * the server keeps the inputs each Player received until a step applies them.
+ */
+class InputHistory {
+    PlayerInput inputs[INPUT_HISTORY];
+
+public:
+    // Slot for a new input, replaces the one INPUT_HISTORY sequences older
+    inline PlayerInput& add(uint32_t sequence){
+        PlayerInput &in = inputs[sequence % INPUT_HISTORY];
+        in.sequence = sequence;
+        return in;
+    }
+
+    // Returns nullptr if the input was never stored or has been replaced
+    inline const PlayerInput* get(uint32_t sequence) const {
+        const PlayerInput &in = inputs[sequence % INPUT_HISTORY];
+        return sequence != 0 && in.sequence == sequence ? &in : nullptr;
+    }
+};
 
 class Player {
 
@@ -63,10 +96,29 @@ public:
 
     uint32_t climbing_plant = PLANT_NULL;
 
+    // Server only, the last snapshot the player's client acknowledged, 0 if none
+    uint32_t acked_snapshot = 0;
+
+    // Server only, inputs received and not yet applied
+    InputHistory inputs;
+    uint32_t input_sequence = 0;    // Server only, the last input applied by a step
+    uint32_t received_input = 0;    // Server only, the newest input received
+
     Player();
     void update_logic();
     void update_motion();
 
+    // Collision and constraints of a single player, PlayerSet applies these to every player
+    void update_terrain_collision( Terrain *terrain );
+    void apply_bouyant_force( float water_level );
+    void snap_state();
+
+    // Clientside, runs one step of the player alone, used to predict inputs again without the rest of the scene
+    void predict_step( Terrain *terrain, float water_level );
+
+    // Serverside, forgets the snapshot and input sequences of a previous connection
+    void reset_connection();
+
     static void init_assets();
     static void close_assets();
     void clear();
@@ -100,6 +152,16 @@ class PlayerSet {
 
 public:
 
+    // Server: snapshots sent to clients, client: snapshots received from the server
+    SnapshotHistory snapshots;
+    uint32_t snapshot_id = 0;   // Server: the last snapshot taken, client: the last snapshot applied
+    uint32_t acked_input = 0;   // Client only, the last input of the active player applied by the server in that snapshot
+
+    // Client only, the active player's inputs sent to the server
+    // Kept on the set rather than the player, the active slot moves when lower slots log out
+    InputHistory inputs;
+    uint32_t input_sequence = 0;    // The last input recorded
+
     // Accessors
     // Get the slot of a current player by username, return MAX_PLAYERS on null
     uint8_t get_slot(std::string username);
@@ -130,6 +192,23 @@ public:
         return active_player_slot;
     }
 
+    // Serverside, the peer of a player slot
+    inline ENetPeer* get_peer( uint8_t i ){
+        return i < player_count ? peers[i] : nullptr;
+    }
+
+    // Quantize every player into s
+    void take_snapshot( Snapshot &s );
+
+    // Set the players from a snapshot, the active player keeps its own input and look rotation
+    void apply_snapshot( const Snapshot &s );
+
+    // Clientside, stores the active player's current controls as the next input
+    void record_input();
+
+    // Clientside, after applying a snapshot the active player's inputs the server has not applied yet are predicted again
+    void reconcile( Terrain *terrain, float water_level );
+
 
     // Login/out
     // Serverside, attempts to log a user in, returns the player slot,  returns MAX_PLAYERS on null
@@ -144,8 +223,20 @@ public:
     // Kick all players
     void kick_all();
 
+    // The player tree published by the last update_collision, safe to query from any thread
+    inline std::shared_ptr<const DBVHSnapshot> get_snapshot() const {
+        return player_dbvh.get_snapshot();
+    }
+
+    // Closest player hit by the ray origin + dir*t, skipping the ignored slot, returns MAX_PLAYERS on a miss
+    // Uses the tree from the last update_collision, max_t is set to the distance of the hit
+    uint8_t raycast( const vec3 origin, const vec3 dir, float &max_t, uint8_t ignore = MAX_PLAYERS );
+
         // Update Functions (in application order)
 
+        // Serverside, applies the next received input of each player, one input per step
+        void apply_inputs();
+
         // Applies any player logic, it is safe to query and modify the state
         void update_logic();
 
@@ -161,6 +252,9 @@ public:
         // Applies an upwards force for players below given water level, safe to do after collision
         void apply_bouyant_force( float water_level );
 
+        // Rounds positions and velocities to the fixed-point grid, done last when PHYSICS_DETERMINISTIC is set
+        void snap_state();
+
         // Clientside, updates armatures
         void update_armatures();
 
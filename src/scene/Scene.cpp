@@ -1,4 +1,5 @@
 #include "Scene.h"
+#include "Profiler.h"
 
 #include <iostream>
 
@@ -11,17 +12,24 @@ Scene::~Scene(){
 }
 
 void Scene::draw(float interp_fac){
+    PROFILE_ZONE("Scene::draw");
 
     // View Mode
     Player *active_player = player_set.get_active();
     Armature *active_armature = player_set.get_active_armature();
     if(active_player && active_armature){
-        vec3 forward = {0,0,-2};
+        vec3 forward = {0,0,-2}, boom;
         vec3 up = {0,1,0};
         glm_quat_rotatev(view.rot, forward, forward);
         glm_quat_for(forward, up, active_player->look_rot);
-        glm_vec3_sub(active_armature->get_transform_buffer()[0][3], forward, forward);
-        glm_vec3_copy(forward,view.pos);
+
+        // Pull the camera in front of anything between it and the player
+        RayHit hit;
+        float *pivot = active_armature->get_transform_buffer()[0][3];
+        glm_vec3_negate_to(forward, boom);
+        if(raycast(pivot, boom, 1, hit, RayHit::TERRAIN | RayHit::ENTITY))
+            glm_vec3_scale(boom, fmax(hit.t - CAMERA_BOOM_MARGIN, 0), boom);
+        glm_vec3_add(pivot, boom, view.pos);
         view.update();
     }
 
@@ -78,6 +86,7 @@ void Scene::draw(float interp_fac){
 }
 
 void Scene::update(){
+    PROFILE_ZONE("Scene::update");
 
     // Sky day/night cycle
     // sky.t += 0.01f;
@@ -99,12 +108,64 @@ void Scene::update(){
     player_set.update_collision();
     player_set.update_terrain_collision(&terrain);
     player_set.apply_bouyant_force(water.getWaterLevel());
+    if(PHYSICS_DETERMINISTIC)
+        player_set.snap_state();
 
     plant_system.update(terrain, water.getWaterLevel());
+
+    // Players let go of plants that were removed
+    for(uint8_t i = 0; i < player_set.count(); ++i){
+        Player &p = player_set.at(i);
+        if(p.climbing_plant != PLANT_NULL && !plant_system.get_plant(p.climbing_plant))
+            p.climbing_plant = PLANT_NULL;
+    }
     entity_system.update();
 
 }
 
+void Scene::reconcile(){
+    player_set.reconcile(&terrain, water.getWaterLevel());
+}
+
+bool Scene::raycast(const vec3 origin, const vec3 dir, float max_t, RayHit &hit, uint8_t mask, uint8_t ignore_player){
+    hit.type = RayHit::NONE;
+
+    if(mask & RayHit::TERRAIN){
+        if(terrain.raycast(origin, dir, max_t)){
+            hit.type = RayHit::TERRAIN;
+            hit.id = 0;
+        }
+    }
+    if(mask & RayHit::PLAYER){
+        uint8_t slot = player_set.raycast(origin, dir, max_t, ignore_player);
+        if(slot != MAX_PLAYERS){
+            hit.type = RayHit::PLAYER;
+            hit.id = slot;
+        }
+    }
+    if(mask & RayHit::PLANT){
+        PlantID plant = plant_system.raycast(origin, dir, max_t);
+        if(plant != PLANT_NULL){
+            hit.type = RayHit::PLANT;
+            hit.id = plant;
+        }
+    }
+    if(mask & RayHit::ENTITY){
+        EntityID entity = entity_system.raycast(origin, dir, max_t);
+        if(entity != null_entity){
+            hit.type = RayHit::ENTITY;
+            hit.id = entity;
+        }
+    }
+
+    if(hit.type == RayHit::NONE)
+        return false;
+    hit.t = max_t;
+    glm_vec3_copy((float*)origin, hit.pos);
+    glm_vec3_muladds((float*)dir, max_t, hit.pos);
+    return true;
+}
+
 void Scene::init_client(Client *client){
     // This is only for the client, assets are unused by server
     init_assets();
@@ -16,6 +16,25 @@
 #include "Player.h"
 #include "Plant.h"
 
+/*
+ * Result of a world ray cast, id is the player slot, plant id or entity id depending on the type.
+ * The ray types can be combined as a mask to select what the ray can hit.
+ */
+struct RayHit {
+    enum Type : uint8_t {
+        NONE = 0x00,
+        TERRAIN = 0x01,
+        PLAYER = 0x02,
+        PLANT = 0x04,
+        ENTITY = 0x08,
+        ALL = 0x0f
+    };
+    Type type = NONE;
+    uint32_t id = 0;
+    float t = 0;
+    vec3 pos = GLM_VEC3_ZERO_INIT;
+};
+
 class Scene {
 
     Shader terrain_shader, object_shader, anim_shader, plant_shader;
@@ -43,5 +62,15 @@ public:
     void close_assets();
     void draw(float interp_fac);
     void update();
+
+    // Clientside, predicts the active player's unacknowledged inputs again after a snapshot
+    void reconcile();
+
+    /*
+     * Cast the ray origin + dir*t for t in [0, max_t] against everything selected by mask.
+     * Each system shortens the ray for the next, so only hits in front of the closest so far are tested.
+     * ignore_player is a player slot to skip, such as the player the ray starts in.
+     */
+    bool raycast(const vec3 origin, const vec3 dir, float max_t, RayHit &hit, uint8_t mask = RayHit::ALL, uint8_t ignore_player = MAX_PLAYERS);
 };
 #endif // SCENE_H
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <queue>
 #include "../graphics/DebugDraw.h"
+#include "../physics/Collide.h"
 #include <glm/gtc/noise.hpp>
 
 
@@ -21,6 +22,15 @@ void Terrain::generate() {
     }
 
     // smoothNoise();
+    updateCellBounds();
+}
+
+void Terrain::updateCellBounds(){
+    for( uint32_t z = 0; z < TERRAIN_CELLS; ++z ) {
+        for( uint32_t x = 0; x < TERRAIN_CELLS; ++x ) {
+            cell_max[z][x] = std::max( std::max( data[z][x], data[z][x+1] ), std::max( data[z+1][x], data[z+1][x+1] ) );
+        }
+    }
 }
 
 
@@ -185,9 +195,13 @@ float barycentric(vec3 a, vec3 b, vec3 c, float x, float z){
 }
 
 void Terrain::pointProjection(vec3 p, vec3 normal){
-    // Out of bounds case
+    // Out of bounds case, the last sample row has no cell
+    if(p[0] < 0 || p[2] < 0){
+        p[1] = 0;
+        return;
+    }
     unsigned int x = p[0]/ TERRAIN_SCALE, z = p[2]/ TERRAIN_SCALE;
-    if(x < 0 || x >= TERRAIN_DIM || z < 0 || z >= TERRAIN_DIM ){
+    if(x >= TERRAIN_CELLS || z >= TERRAIN_CELLS ){
         p[1] = 0;
         return;
     }
@@ -287,6 +301,335 @@ void Terrain::pointProjection(vec3 p, vec3 normal){
     }
 }
 
-void collide(CollisionShape a, vec3 resolve){
+bool Terrain::cellRange(AABB &aabb, int &x0, int &z0, int &x1, int &z1){
+    const float *lo = aabb.lower(), *hi = aabb.upper();
+    x0 = std::max( (int)floorf( lo[0] / TERRAIN_SCALE ), 0 );
+    z0 = std::max( (int)floorf( lo[2] / TERRAIN_SCALE ), 0 );
+    x1 = std::min( (int)floorf( hi[0] / TERRAIN_SCALE ), TERRAIN_CELLS - 1 );
+    z1 = std::min( (int)floorf( hi[2] / TERRAIN_SCALE ), TERRAIN_CELLS - 1 );
+    return x0 <= x1 && z0 <= z1;
+}
+
+void Terrain::cellTriangles(int x, int z, vec3 tris[2][3]){
+    vec3 bl = { x * TERRAIN_SCALE, data[z][x] * TERRAIN_HEIGHT_SCALE, z * TERRAIN_SCALE };
+    vec3 br = { (x+1) * TERRAIN_SCALE, data[z][x+1] * TERRAIN_HEIGHT_SCALE, z * TERRAIN_SCALE };
+    vec3 tr = { (x+1) * TERRAIN_SCALE, data[z+1][x+1] * TERRAIN_HEIGHT_SCALE, (z+1) * TERRAIN_SCALE };
+    vec3 tl = { x * TERRAIN_SCALE, data[z+1][x] * TERRAIN_HEIGHT_SCALE, (z+1) * TERRAIN_SCALE };
+
+    // Same split as loadVAO, both triangles are wound so the normal (b-a)x(c-a) faces up
+    if( abs( bl[1] - tr[1] ) > abs( br[1] - tl[1] ) ) {
+        glm_vec3_copy( tr, tris[0][0] );
+        glm_vec3_copy( br, tris[0][1] );
+        glm_vec3_copy( tl, tris[0][2] );
+        glm_vec3_copy( tl, tris[1][0] );
+        glm_vec3_copy( br, tris[1][1] );
+        glm_vec3_copy( bl, tris[1][2] );
+    }
+    else {
+        glm_vec3_copy( tr, tris[0][0] );
+        glm_vec3_copy( br, tris[0][1] );
+        glm_vec3_copy( bl, tris[0][2] );
+        glm_vec3_copy( tr, tris[1][0] );
+        glm_vec3_copy( bl, tris[1][1] );
+        glm_vec3_copy( tl, tris[1][2] );
+    }
+}
+
+/*
+ * One sided sphere-triangle contact, a center below the face is pushed out along the face normal
+ * depth is how far the sphere has to move, resolve points into the triangle
+ */
+static bool sphere_triangle(const vec3 center, float radius, vec3 tri[3], const vec3 normal, float &depth, vec3 resolve){
+    vec3 q, d, ap;
+    bool face = closest_point_triangle( center, tri[0], tri[1], tri[2], q );
+    glm_vec3_sub( (float*)center, tri[0], ap );
+    float height = glm_vec3_dot( ap, (float*)normal );
+
+    // Below the surface, only the face can push out, edges belong to the neighboring triangles
+    if( height < 0 ){
+        if( !face )
+            return false;
+        depth = radius - height;
+        glm_vec3_scale( (float*)normal, -depth, resolve );
+        return true;
+    }
+
+    glm_vec3_sub( (float*)center, q, d );
+    float dist = glm_vec3_norm( d );
+    if( dist >= radius )
+        return false;
+    depth = radius - dist;
+    if( dist > GLM_FLT_EPSILON )
+        glm_vec3_scale( d, -depth / dist, resolve );
+    else
+        glm_vec3_scale( (float*)normal, -depth, resolve );
+    return true;
+}
+
+/*
+ * The point on the segment pq closest to the triangle, the distance along the segment is convex,
+ * so the closest point is an end point, where it crosses the face or the closest point to an edge
+ */
+static void segment_closest_to_triangle(const vec3 p, const vec3 q, vec3 tri[3], const vec3 normal, vec3 dest){
+    vec3 candidates[6], c, t, e;
+    unsigned int count = 0;
+    glm_vec3_copy( (float*)p, candidates[count++] );
+    glm_vec3_copy( (float*)q, candidates[count++] );
+
+    // Crossing the plane
+    glm_vec3_sub( (float*)p, tri[0], t );
+    float hp = glm_vec3_dot( t, (float*)normal );
+    glm_vec3_sub( (float*)q, tri[0], t );
+    float hq = glm_vec3_dot( t, (float*)normal );
+    if( (hp < 0) != (hq < 0) ){
+        glm_vec3_lerp( (float*)p, (float*)q, hp / (hp - hq), candidates[count++] );
+    }
+
+    // Closest to each edge
+    for( unsigned int i = 0; i < 3; ++i )
+        closest_points_segments( p, q, tri[i], tri[(i+1)%3], candidates[count++], e );
+
+    // Below the face counts as a negative distance
+    float best = INFINITY, dist;
+    for( unsigned int i = 0; i < count; ++i ) {
+        bool face = closest_point_triangle( candidates[i], tri[0], tri[1], tri[2], c );
+        glm_vec3_sub( candidates[i], tri[0], t );
+        float height = glm_vec3_dot( t, (float*)normal );
+        dist = face && height < 0 ? height : glm_vec3_distance( candidates[i], c );
+        if( dist < best ) {
+            best = dist;
+            glm_vec3_copy( candidates[i], dest );
+        }
+    }
+}
+
+bool Terrain::deepestContact(CollisionShape &shape, vec3 resolve){
+    float best = 0, depth, floor_height = 0;
+    vec3 r;
+    const float *lo = shape.aabb.lower();
+
+    // The floor plane, the heightfield never goes below it so the lowest point of the box is exact
+    if( lo[1] < floor_height ) {
+        best = floor_height - lo[1];
+        glm_vec3_zero( resolve );
+        resolve[1] = -best;
+    }
+
+    int x0, z0, x1, z1;
+    if( !cellRange( shape.aabb, x0, z0, x1, z1 ) )
+        return best > 0;
+
+    // Capsules are tested as spheres at the point of their segment closest to each triangle
+    vec3 seg_p, seg_q, center;
+    if( shape.type == SHAPE_CAPSULE )
+        capsule_segment( (Capsule&)shape, seg_p, seg_q );
+
+    vec3 tris[2][3], normal, ab, ac;
+    Triangle tri;
+    for( int z = z0; z <= z1; ++z ) {
+        for( int x = x0; x <= x1; ++x ) {
+            // The shape is above the highest point of the cell
+            if( cell_max[z][x] * TERRAIN_HEIGHT_SCALE < lo[1] )
+                continue;
+
+            cellTriangles( x, z, tris );
+            for( unsigned int i = 0; i < 2; ++i ) {
+                glm_vec3_sub( tris[i][1], tris[i][0], ab );
+                glm_vec3_sub( tris[i][2], tris[i][0], ac );
+                glm_vec3_cross( ab, ac, normal );
+                glm_vec3_normalize( normal );
+
+                bool hit;
+                switch( shape.type ) {
+                    case SHAPE_SPHERE:
+                        hit = sphere_triangle( shape.pos, ((Sphere&)shape).radius, tris[i], normal, depth, r );
+                        break;
+                    case SHAPE_CAPSULE:
+                        segment_closest_to_triangle( seg_p, seg_q, tris[i], normal, center );
+                        hit = sphere_triangle( center, ((Capsule&)shape).radius, tris[i], normal, depth, r );
+                        break;
+                    default:
+                        // The triangle support extends below the face like a prism
+                        glm_vec3_copy( tris[i][0], tri.points[0] );
+                        glm_vec3_copy( tris[i][1], tri.points[1] );
+                        glm_vec3_copy( tris[i][2], tri.points[2] );
+                        glm_vec3_zero( r );
+                        hit = CollisionShape::gjk( shape, tri, r );
+                        depth = glm_vec3_norm( r );
+                        break;
+                }
+
+                if( hit && depth > best ) {
+                    best = depth;
+                    glm_vec3_copy( r, resolve );
+                }
+            }
+        }
+    }
+    return best > 0;
+}
+
+bool Terrain::collide(CollisionShape &shape, vec3 resolve){
+    vec3 start, r;
+    glm_vec3_copy( shape.pos, start );
+    glm_vec3_zero( resolve );
+
+    // Resolve the deepest contact and test again, a shape can rest on several triangles
+    shape.updateAABB();
+    bool hit = false;
+    for( unsigned int i = 0; i < TERRAIN_COLLIDE_ITERATIONS; ++i ) {
+        if( !deepestContact( shape, r ) )
+            break;
+        hit = true;
+        glm_vec3_add( resolve, r, resolve );
+        glm_vec3_sub( shape.pos, r, shape.pos );
+        shape.updateAABB();
+    }
+
+    glm_vec3_copy( start, shape.pos );
+    shape.updateAABB();
+    return hit;
+}
+
+bool Terrain::raycast(const vec3 origin, const vec3 dir, float &max_t, vec3 normal){
+    const float size = TERRAIN_CELLS * TERRAIN_SCALE;
+    bool hit = false;
+    float t;
+    vec3 p;
+
+    // Floor plane, only outside of the heightfield
+    if( dir[1] < 0 && origin[1] >= 0 ){
+        t = -origin[1] / dir[1];
+        glm_vec3_copy( (float*)origin, p );
+        glm_vec3_muladds( (float*)dir, t, p );
+        if( t <= max_t && ( p[0] < 0 || p[2] < 0 || p[0] > size || p[2] > size ) ){
+            max_t = t;
+            hit = true;
+            if( normal ){
+                normal[0] = normal[2] = 0;
+                normal[1] = 1;
+            }
+        }
+    }
+
+    // Clip the ray to the heightfield
+    vec3 lo = {0, 0, 0}, hi = {size, 255 * TERRAIN_HEIGHT_SCALE, size};
+    vec3 inv_dir = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    AABB bounds( lo, hi );
+    float t_cell;
+    if( !bounds.ray_intersect( origin, inv_dir, max_t, t_cell ) )
+        return hit;
+
+    // Walk the cells crossed by the ray (Amanatides and Woo), t_next is where the ray enters the next column or row
+    glm_vec3_copy( (float*)origin, p );
+    glm_vec3_muladds( (float*)dir, t_cell, p );
+    int x = glm_clamp( (int)floorf( p[0] / TERRAIN_SCALE ), 0, TERRAIN_CELLS - 1 );
+    int z = glm_clamp( (int)floorf( p[2] / TERRAIN_SCALE ), 0, TERRAIN_CELLS - 1 );
+    int step_x = dir[0] > 0 ? 1 : -1, step_z = dir[2] > 0 ? 1 : -1;
+    float t_next_x = dir[0] != 0 ? ( (x + (step_x > 0)) * TERRAIN_SCALE - origin[0] ) / dir[0] : INFINITY;
+    float t_next_z = dir[2] != 0 ? ( (z + (step_z > 0)) * TERRAIN_SCALE - origin[2] ) / dir[2] : INFINITY;
+    float t_delta_x = dir[0] != 0 ? TERRAIN_SCALE / fabsf( dir[0] ) : INFINITY;
+    float t_delta_z = dir[2] != 0 ? TERRAIN_SCALE / fabsf( dir[2] ) : INFINITY;
+
+    vec3 tris[2][3];
+    float t_exit, y_min;
+    bool cell_hit = false;
+    while( x >= 0 && z >= 0 && x < TERRAIN_CELLS && z < TERRAIN_CELLS && t_cell <= max_t ){
+        t_exit = fminf( fminf( t_next_x, t_next_z ), max_t );
+
+        // The lowest point of the ray over the cell is at one of its ends
+        y_min = origin[1] + dir[1] * ( dir[1] < 0 ? t_exit : t_cell );
+        if( y_min <= cell_max[z][x] * TERRAIN_HEIGHT_SCALE ){
+            cellTriangles( x, z, tris );
+            for(unsigned int i = 0; i < 2; ++i){
+                if( !ray_triangle( origin, dir, tris[i][0], tris[i][1], tris[i][2], max_t, t ) )
+                    continue;
+                max_t = t;
+                cell_hit = hit = true;
+                if( normal ){
+                    vec3 ab, ac;
+                    glm_vec3_sub( tris[i][1], tris[i][0], ab );
+                    glm_vec3_sub( tris[i][2], tris[i][0], ac );
+                    glm_vec3_cross( ab, ac, normal );
+                    glm_vec3_normalize( normal );
+                }
+            }
+            // Cells are visited in order, the first hit is the closest
+            if( cell_hit )
+                return true;
+        }
+
+        if( t_next_x < t_next_z ){
+            x += step_x;
+            t_cell = t_next_x;
+            t_next_x += t_delta_x;
+        }
+        else {
+            z += step_z;
+            t_cell = t_next_z;
+            t_next_z += t_delta_z;
+        }
+    }
+    return hit;
+}
+
+bool Terrain::sweep(CollisionShape &shape, vec3 motion, float &t){
+    vec3 start, r;
+    glm_vec3_copy( shape.pos, start );
+    shape.updateAABB();
+    t = 0;
+
+    // Reject if the swept box is above every cell under it
+    AABB moved = shape.aabb;
+    moved.translate( motion );
+    AABB swept = shape.aabb | moved;
+    int x0, z0, x1, z1;
+    float highest = 0;
+    if( cellRange( swept, x0, z0, x1, z1 ) ) {
+        for( int z = z0; z <= z1; ++z )
+            for( int x = x0; x <= x1; ++x )
+                highest = std::max( highest, cell_max[z][x] * TERRAIN_HEIGHT_SCALE );
+    }
+    if( swept.lower()[1] > highest )
+        return false;
+
+    // A shape that starts in contact may slide along the surface, only a deeper contact stops it
+    float start_depth = deepestContact( shape, r ) ? glm_vec3_norm( r ) : 0;
+    start_depth += SWEEP_SLOP;
+
+    // Steps of a quarter of the smallest box dimension, well under the size of the shape
+    float extent = INFINITY;
+    for( unsigned int i = 0; i < 3; ++i )
+        extent = std::min( extent, shape.aabb.upper()[i] - shape.aabb.lower()[i] );
+    float length = glm_vec3_norm( motion );
+    unsigned int steps = std::max( 1.0f, ceilf( length / std::max( extent * .25f, 0.001f ) ) );
+
+    bool hit = false;
+    float prev = 0, next;
+    for( unsigned int i = 1; i <= steps && !hit; ++i ) {
+        next = (float)i / steps;
+        glm_vec3_copy( start, shape.pos );
+        glm_vec3_muladds( motion, next, shape.pos );
+        shape.updateAABB();
+        if( deepestContact( shape, r ) && glm_vec3_norm( r ) > start_depth ) {
+            // Bisect between the last free position and the contact
+            hit = true;
+            for( unsigned int b = 0; b < SWEEP_BISECTIONS; ++b ) {
+                float mid = (prev + next) * .5f;
+                glm_vec3_copy( start, shape.pos );
+                glm_vec3_muladds( motion, mid, shape.pos );
+                shape.updateAABB();
+                if( deepestContact( shape, r ) && glm_vec3_norm( r ) > start_depth )
+                    next = mid;
+                else
+                    prev = mid;
+            }
+            t = prev;
+        }
+        prev = next;
+    }
 
+    glm_vec3_copy( start, shape.pos );
+    shape.updateAABB();
+    return hit;
 }
@@ -7,17 +7,57 @@
 #include <cglm/cglm.h>
 #include "./physics/CollisionShape.h"
 
+#define TERRAIN_CELLS (TERRAIN_DIM - 1)
+#define TERRAIN_COLLIDE_ITERATIONS 4    // Contacts resolved per collision query, the deepest is resolved first
+
+/*
+ * Heightfield of TERRAIN_DIM samples, cell (x, z) spans samples x to x+1 and z to z+1.
+ * The area outside of the heightfield is a floor plane at a height of 0.
+ */
 class Terrain {
     uint8_t data[TERRAIN_DIM][TERRAIN_DIM];
 
+    // Highest sample of each cell, cells that can not reach a shape are skipped
+    uint8_t cell_max[TERRAIN_CELLS][TERRAIN_CELLS];
+
     inline void createPlane(float ax, float az, float bx, float bz, float ay, float by, std::vector<float> &pos,  std::vector<uint32_t> &index );
     void generateNormals(std::vector<float> &pos, std::vector<uint32_t> &index, std::vector<float> &norm);
+    void updateCellBounds();
+
+    // Cells under an AABB, returns false if there are none
+    bool cellRange(AABB &aabb, int &x0, int &z0, int &x1, int &z1);
+
+    // The two triangles of a cell, split the same way as the mesh, with upwards normals
+    void cellTriangles(int x, int z, vec3 tris[2][3]);
+
+    // The deepest contact of the shape with any cell under it, or with the floor plane
+    bool deepestContact(CollisionShape &shape, vec3 resolve);
 
 public :
     void generate();
     void loadVAO(VAO& vao);
 
-    void collide(CollisionShape a, vec3 resolve);
+    /*
+     * Collide a shape with the heightfield, only the cells under the shape's AABB are visited.
+     * resolve is the total penetration, the shape is separated by moving -resolve (same as CollisionShape::gjk).
+     * Spheres and capsules use closed form contacts, other shapes use GJK against the cell triangles.
+     */
+    bool collide(CollisionShape &shape, vec3 resolve);
+
+    /*
+     * Move a shape along motion and find the first contact, t is the fraction of motion before the contact.
+     * The motion is divided into steps shorter than the shape so it can not pass through a cell.
+     * A shape already in contact only stops when the contact gets deeper. The shape is not moved.
+     */
+    bool sweep(CollisionShape &shape, vec3 motion, float &t);
+
+    /*
+     * Ray origin + dir*t against the heightfield and floor plane for t in [0, max_t].
+     * The cells under the ray are walked in order (DDA), cells the ray passes above are skipped.
+     * On a hit max_t is set to the distance and the optional normal to the surface normal.
+     */
+    bool raycast(const vec3 origin, const vec3 dir, float &max_t, vec3 normal = nullptr);
+
     void pointProjection(vec3 p, vec3 normal = nullptr);
 
 };
@@ -1,97 +1,257 @@
 #include "Packet.h"
 #include "ClientConnection.h"
 #include "ServerConnection.h"
+#include "Serialize.h"
 #include <string.h>
 
-// NOTE Does not support inter-system endian changes, all systems must be little endian.
-// Each encode and decode function shifts the pointer the amount used, do not simply pass in the original data pointer
-// It is important that a packet correctly preallocates its size for ENet packets
-
-// Encode a single type, this type should be a POD type only
-template<typename T> void encode(T t, ENetPacket *pac, unsigned int &offset ){
-    if( pac->dataLength < offset + sizeof(T))
-        enet_packet_resize( pac, pac->dataLength + ( offset+sizeof(T) - pac->dataLength) );
-    T *tp = (T*)(pac->data + offset);
-    *tp = t;
-    offset += sizeof(T);
+// Packets are written into the sending thread's scratch buffer, then copied into an ENet packet of the exact size.
+// The scratch buffer keeps its capacity, so writing only allocates until it has grown to the largest packet sent.
+static thread_local PacketBuffer packet_scratch;
+
+/*
+ * Packet field lists, see Serialize.h.
+ * Fields may only be appended, with the protocol version that added them.
+ */
+struct LoginMessage {
+    std::string username;
+    std::string passkey;
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &LoginMessage::username ), field( &LoginMessage::passkey ) );
+    }
 };
 
-// Encode an array of exact size that the sender and reciever agree on
-template<typename T> void encode_array(T *t, uint8_t count, ENetPacket *pac, unsigned int &offset){
-    unsigned int size = sizeof(T)*count;
-    if( pac->dataLength < offset + size )
-        enet_packet_resize( pac, pac->dataLength + ( offset + size - pac->dataLength) );
-    memcpy(pac->data + offset, t, size );
-    offset += size;
+struct KickMessage {
+    std::string reason;
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &KickMessage::reason ) );
+    }
 };
 
-// Encode a vector of values up to 255 values
-template<typename T> void encode_vec(std::vector<T> &t, ENetPacket *pac, unsigned int &offset){
-    uint8_t length = std::min(t.size, UINT8_MAX);
-    unsigned int size = length * sizeof(T);
-    if( pac->dataLength < offset + size + 1)
-        enet_packet_resize( pac, pac->dataLength + ( offset + size + 1 - pac->dataLength) );
-    pac->data[offset] = length;
-    ++offset;
-    memcpy(pac->data + offset, t, size );
-    offset += size;
+struct InputEntry {
+    uint16_t input_flag = 0;
+    uint32_t look_rot = 0;      // Quantized
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &InputEntry::input_flag ), field( &InputEntry::look_rot ) );
+    }
 };
 
-// Encode a string up to 255 chars
-void encode_string(std::string &str, ENetPacket *pac, unsigned int &offset){
-    uint8_t length = std::min((int)str.size(), UINT8_MAX);
-    if( pac->dataLength < offset + length + 1 )
-        enet_packet_resize( pac, pac->dataLength + ( offset + length + 1 - pac->dataLength) );
-    pac->data[offset] = length;
-    ++offset;
-    memcpy(pac->data + offset, str.data(), length );
-    offset += length;
+struct InputMessage {
+    uint16_t input_flag = 0;
+    float look_rot[4] = {0, 0, 0, 1};  // Unaligned, a versor's alignment does not carry through templates
+    uint32_t sequence = 0;              // 0 from version 1 senders, which only send the current input
+    std::vector<InputEntry> inputs;     // Newest input first, inputs[k] has the sequence sequence - k
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &InputMessage::input_flag ), field( &InputMessage::look_rot ),
+                                field( &InputMessage::sequence, 2 ), field( &InputMessage::inputs, 2 ) );
+    }
 };
 
-// Decode a single type
-template<typename T> void decode(T &t, ENetPacket *pac, unsigned int &offset){
-    T *tp = (T*)( pac->data + offset );
-    t = *tp;
-    offset += sizeof(T);
+struct StatusMessage {
+    std::vector<std::string> usernames;
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &StatusMessage::usernames ) );
+    }
 };
 
-// Decode a fixed-size array of types
-template<typename T> void decode_array(T *t, uint8_t count, ENetPacket *pac, unsigned int &offset){
-    unsigned int s = sizeof(T)*count;
-    s = std::min(s,(unsigned int)pac->dataLength);
-    memcpy(t, pac->data + offset, s);
-    offset += s;
+// Followed by count player deltas
+struct SnapshotHeader {
+    uint32_t id = 0;
+    uint32_t baseline_id = 0;   // 0 if every field is sent
+    uint8_t count = 0;
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &SnapshotHeader::id ), field( &SnapshotHeader::baseline_id ), field( &SnapshotHeader::count ) );
+    }
 };
 
-// Decode a variable-sized array of types
-template<typename T> void decode_vec(std::vector<T> &t, ENetPacket *pac, unsigned int &offset){
-    uint8_t count = pac->data[offset];
-    ++offset;
-    t.resize(count);
-    unsigned int s = sizeof(T) * count;
-    s = std::min(s,(unsigned int)pac->dataLength);
-    memcpy(t.data(), pac->data + offset, s);
-    offset += s;
+// Follows the player deltas, only the end of a packet can gain fields
+struct SnapshotTrailer {
+    uint32_t input_ack = 0;     // The last input of the receiving client's player applied by the server
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &SnapshotTrailer::input_ack, 2 ) );
+    }
 };
 
-void decode_string(std::string &str, ENetPacket *pac, unsigned int &offset){
-    uint8_t count = pac->data[offset];
-    ++offset;
-    str.resize(count);
-    count = std::min((unsigned int)count,(unsigned int)pac->dataLength);
-    memcpy(str.data(), pac->data + offset, count);
-    offset += count;
+struct AckMessage {
+    uint32_t id = 0;
+
+    static constexpr auto fields(){
+        return std::make_tuple( field( &AckMessage::id ) );
+    }
 };
 
-#define packet_create(packet_size) unsigned int offset = 0; ENetPacket *packet = enet_packet_create(nullptr, packet_size, ENET_PACKET_FLAG_RELIABLE);
-#define packet_send enet_peer_send(dest, 0, packet);
-#define packet_broadcast enet_host_broadcast(host, 0, packet);
+// Every packet starts with its type and the protocol version of the sender
+void write_header(PacketWriter &w, packet_type type){
+    uint8_t header[PACKET_HEADER_SIZE] = { type, PROTOCOL_VERSION };
+    w.write_bytes(header, PACKET_HEADER_SIZE);
+}
+
+// Reader positioned after the header, it has already failed if the packet is shorter than the header
+PacketReader read_header(ENetPacket *packet){
+    PacketReader r(packet->data, packet->dataLength, packet->dataLength >= PACKET_HEADER_SIZE ? packet->data[1] : 0);
+    r.view(PACKET_HEADER_SIZE);
+    return r;
+}
+
+// ENet flags of a delivery class
+inline enet_uint32 packet_flags(Packet::Delivery delivery){
+    return delivery == Packet::DELIVERY_RELIABLE ? ENET_PACKET_FLAG_RELIABLE : 0;
+}
+
+// Queue a packet, ENet only takes ownership if the send succeeds
+inline void send_packet(ENetPeer *dest, Packet::Delivery delivery, ENetPacket *packet){
+    if( enet_peer_send(dest, delivery, packet) < 0 )
+        enet_packet_destroy(packet);
+}
+
+/*
+ * Header of one allocation shared by several ENet packets created with ENET_PACKET_FLAG_NO_ALLOCATE,
+ * the packet data follows it. It is freed when the last reference is released.
+ */
+struct SharedPacketData {
+    unsigned int references;
+
+    inline uint8_t* data(){
+        return (uint8_t*)(this + 1);
+    }
+};
+
+void release_shared_packet_data(SharedPacketData *shared){
+    if( --shared->references == 0 )
+        enet_free(shared);
+}
+
+// Called by ENet when it destroys a packet pointing into shared data
+void destroy_shared_packet(ENetPacket *packet){
+    release_shared_packet_data((SharedPacketData*)packet->userData);
+}
+
+/*
+ * Fields of a player snapshot that differ from the baseline, players without a baseline send every field.
+ * Positions and velocities that moved a little are sent as 8 bit differences.
+ */
+enum SnapshotField : uint8_t {
+    FIELD_MODE = 0x01,              // Move mode and input flag
+    FIELD_POS = 0x02,
+    FIELD_POS_SMALL = 0x04,
+    FIELD_ROT = 0x08,
+    FIELD_LOOK = 0x10,
+    FIELD_VELOCITY = 0x20,
+    FIELD_VELOCITY_SMALL = 0x40
+};
+
+// Differences of each axis from the baseline, returns false if any does not fit in 8 bits
+template<typename T> bool small_delta(const T *value, const T *base, int8_t *delta){
+    int d;
+    for(unsigned int i = 0; i < 3; ++i){
+        d = (int)value[i] - (int)base[i];
+        if(d < INT8_MIN || d > INT8_MAX)
+            return false;
+        delta[i] = d;
+    }
+    return true;
+}
+
+void write_player_delta(PacketWriter &w, const PlayerSnapshot &q, const PlayerSnapshot *base){
+    int8_t pos_delta[3], velocity_delta[3];
+    uint8_t fields = FIELD_MODE | FIELD_POS | FIELD_ROT | FIELD_LOOK | FIELD_VELOCITY;
+    if(base){
+        fields = 0;
+        if(q.move_mode != base->move_mode || q.input_flag != base->input_flag)
+            fields |= FIELD_MODE;
+        if(memcmp(q.pos, base->pos, sizeof(q.pos)) != 0)
+            fields |= small_delta(q.pos, base->pos, pos_delta) ? FIELD_POS_SMALL : FIELD_POS;
+        if(q.rot != base->rot)
+            fields |= FIELD_ROT;
+        if(q.look_rot != base->look_rot)
+            fields |= FIELD_LOOK;
+        if(memcmp(q.velocity, base->velocity, sizeof(q.velocity)) != 0)
+            fields |= small_delta(q.velocity, base->velocity, velocity_delta) ? FIELD_VELOCITY_SMALL : FIELD_VELOCITY;
+    }
+
+    write(w, fields);
+    if(fields & FIELD_MODE){
+        write(w, q.move_mode);
+        write(w, q.input_flag);
+    }
+    if(fields & FIELD_POS)
+        write(w, q.pos);
+    if(fields & FIELD_POS_SMALL)
+        write(w, pos_delta);
+    if(fields & FIELD_ROT)
+        write(w, q.rot);
+    if(fields & FIELD_LOOK)
+        write(w, q.look_rot);
+    if(fields & FIELD_VELOCITY)
+        write(w, q.velocity);
+    if(fields & FIELD_VELOCITY_SMALL)
+        write(w, velocity_delta);
+}
+
+// Returns false if the delta is truncated or malformed
+bool read_player_delta(PacketReader &r, PlayerSnapshot &q, const PlayerSnapshot *base){
+    int8_t delta[3];
+    uint8_t fields;
+    q = base ? *base : PlayerSnapshot();
+
+    if(!read(r, fields) || (fields & ~(FIELD_VELOCITY_SMALL*2 - 1)))
+        return false;
+    if(fields & FIELD_MODE){
+        if(!read(r, q.move_mode) || !read(r, q.input_flag) || q.move_mode > Player::CLIMB)
+            return false;
+    }
+    if(fields & FIELD_POS)
+        read(r, q.pos);
+    if((fields & FIELD_POS_SMALL) && read(r, delta))
+        for(unsigned int i = 0; i < 3; ++i)
+            q.pos[i] += delta[i];
+    if(fields & FIELD_ROT)
+        read(r, q.rot);
+    if(fields & FIELD_LOOK)
+        read(r, q.look_rot);
+    if(fields & FIELD_VELOCITY)
+        read(r, q.velocity);
+    if((fields & FIELD_VELOCITY_SMALL) && read(r, delta))
+        for(unsigned int i = 0; i < 3; ++i)
+            q.velocity[i] += delta[i];
+    return r.ok();
+}
+
+// The delivery class of the packet type sets the packet flags and the channel it is sent on
+// Sending copies the written bytes into a single ENet allocation
+#define packet_create(type) Delivery delivery = get_delivery(type); PacketWriter packet(packet_scratch); write_header(packet, type);
+#define packet_send send_packet(dest, delivery, enet_packet_create(packet.data(), packet.size(), packet_flags(delivery)));
+#define packet_broadcast enet_host_broadcast(host, delivery, enet_packet_create(packet.data(), packet.size(), packet_flags(delivery)));
 namespace Packet{
 
+    Delivery get_delivery(packet_type type){
+        switch(type){
+            case PACKET_PLAYER_INPUT:
+            case PACKET_PLAYER_SYNCH:
+            case PACKET_SNAPSHOT_ACK:
+                return DELIVERY_SEQUENCED;
+            default:
+                return DELIVERY_RELIABLE;
+        }
+    }
+
+    packet_type get_type(ENetPacket *packet){
+        if(packet->dataLength < PACKET_HEADER_SIZE || packet->data[1] < PROTOCOL_MIN_VERSION)
+            return PACKET_INVALID;
+        return packet->data[0];
+    }
+
     /*
      * Send functions take in the desired arguments and make a packet.
      * Broadcast functions are server only and broadcast instead of sending.
-     * Receive functions decode the packet into the parameters references passed.
+     * Receive functions decode the packet into the parameters references passed,
+     * they return false and leave the parameters unchanged if the packet is truncated or malformed.
      *
      * Sending/broadcasting can be done anywhere in the code as seen fit,
      * as long as the broadcast host/destination peer is given.
@@ -100,127 +260,197 @@ namespace Packet{
 
     // Sending functions for packet creation
     void send_login(std::string &username, std::string &passkey, ENetPeer *dest){
-        packet_create(1)
-        encode( PACKET_LOGIN, packet, offset);
-        encode_string(username, packet, offset);
-        encode_string(passkey, packet, offset);
+        packet_create(PACKET_LOGIN)
+        write(packet, LoginMessage{username, passkey});
         packet_send
     }
 
-    void receive_login(std::string &username, std::string &passkey, ENetPacket *packet){
-        unsigned int offset = 1; // First byte is packet type
-        decode_string(username, packet, offset);
-        decode_string(passkey, packet, offset);
+    bool receive_login(std::string &username, std::string &passkey, ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        LoginMessage m;
+        if(!read(r, m))
+            return false;
+        username = m.username;
+        passkey = m.passkey;
+        return true;
     }
 
     void send_kick(std::string &reason, ENetPeer *dest){
-        packet_create(1)
-        encode( PACKET_KICK, packet, offset);
-        encode_string(reason, packet, offset);
+        packet_create(PACKET_KICK)
+        write(packet, KickMessage{reason});
         packet_send
         // When kicking, force a disconnect with the destination
         enet_peer_disconnect_later(dest,0);
     }
 
-    void receive_kick(std::string &reason, ENetPacket *packet){
-        unsigned int offset = 1; // First byte is packet type
-        decode_string(reason, packet, offset);
+    bool receive_kick(std::string &reason, ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        KickMessage m;
+        if(!read(r, m))
+            return false;
         // The host has disconnected
+        reason = m.reason;
+        return true;
     }
 
-    void send_player_input(Player *p, ENetPeer *dest){
-        packet_create(1)
-        encode( PACKET_PLAYER_INPUT, packet, offset);
-        encode(p->input_flag, packet, offset);
-        encode_array(p->look_rot, 4, packet, offset);
+    void send_player_input(PlayerSet *player_set, ENetPeer *dest){
+        packet_create(PACKET_PLAYER_INPUT)
+        InputMessage m;
+        Player *p = player_set->get_active();
+        m.input_flag = p->input_flag;
+        glm_quat_copy(p->look_rot, m.look_rot);
+        m.sequence = player_set->input_sequence;
+        // Repeat the latest inputs, a lost packet's inputs arrive with the next one
+        const PlayerInput *in;
+        for(uint32_t k = 0; k < INPUT_REDUNDANCY && k < m.sequence && (in = player_set->inputs.get(m.sequence - k)); ++k)
+            m.inputs.push_back(InputEntry{in->input_flag, in->look_rot});
+        write(packet, m);
         packet_send
     }
 
-    void receive_player_input(Player *p,  ENetPacket *packet){
-        unsigned int offset = 1;
-        decode(p->input_flag, packet, offset);
-        decode_array(p->look_rot, 4, packet, offset);
+    bool receive_player_input(Player *p,  ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        InputMessage m;
+        if(!read(r, m) || m.inputs.size() > INPUT_REDUNDANCY || m.inputs.size() > m.sequence)
+            return false;
+
+        // Version 1 clients have no sequences, their input is used as is until the next one
+        if(m.sequence == 0){
+            p->input_flag = m.input_flag;
+            glm_quat_copy(m.look_rot, p->look_rot);
+            return true;
+        }
+
+        // Store the inputs no step has applied yet, they are applied one per step by PlayerSet::apply_inputs
+        uint32_t sequence;
+        for(uint8_t k = 0; k < m.inputs.size(); ++k){
+            sequence = m.sequence - k;
+            if(sequence <= p->input_sequence || p->inputs.get(sequence))
+                continue;
+            PlayerInput &in = p->inputs.add(sequence);
+            in.input_flag = m.inputs[k].input_flag;
+            in.look_rot = m.inputs[k].look_rot;
+        }
+        p->received_input = std::max(p->received_input, m.sequence);
+        return true;
     }
 
 
 
     void broadcast_player_status_synch( PlayerSet *player_set, ENetHost *host){
-        packet_create(1)
-        encode( PACKET_PLAYER_STATUS_SYNCH, packet, offset); // Packet type
-        encode( player_set->count(), packet, offset);   // Specify the player count
+        packet_create(PACKET_PLAYER_STATUS_SYNCH)
         // For each player, place the required status data
-        Player* p;
-        for(uint8_t i = 0; i < player_set->count(); ++i){
-            p = &player_set->at(i);
-            encode_string(p->username, packet, offset);
-        }
+        StatusMessage m;
+        for(uint8_t i = 0; i < player_set->count(); ++i)
+            m.usernames.push_back(player_set->at(i).username);
+        write(packet, m);
         packet_broadcast
     }
 
-    void receive_player_status_synch(PlayerSet *player_set,  ENetPacket *packet){
-        unsigned int offset = 1;
-        uint8_t player_count;
-        decode(player_count, packet, offset);
-        player_set->reserve(player_count);
+    bool receive_player_status_synch(PlayerSet *player_set,  ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        StatusMessage m;
+        if(!read(r, m) || m.usernames.size() > MAX_PLAYERS)
+            return false;
+        player_set->reserve(m.usernames.size());
+        for(uint8_t i = 0; i < player_set->count(); ++i)
+            player_set->at(i).username = m.usernames[i];
+        return true;
+    }
+
+    // Snapshot delta encoded against the baseline, or complete if there is none
+    void write_snapshot(PacketWriter &w, const Snapshot &current, const Snapshot *baseline, uint32_t input_ack){
+        write_header(w, PACKET_PLAYER_SYNCH);
+        write(w, SnapshotHeader{current.id, baseline ? baseline->id : 0, current.count});
+        for(uint8_t i = 0; i < current.count; ++i)
+            write_player_delta(w, current.players[i], baseline && i < baseline->count ? &baseline->players[i] : nullptr);
+        write(w, SnapshotTrailer{input_ack});
+    }
+
+    void broadcast_player_synch( PlayerSet *player_set, ENetHost *){
+        Snapshot &current = player_set->snapshots.add(++player_set->snapshot_id);
+        player_set->take_snapshot(current);
+
+        // Each client gets the changes since the last snapshot it acknowledged,
+        // every client's packet is written back to back so they can share one allocation
+        Delivery delivery = get_delivery(PACKET_PLAYER_SYNCH);
+        PacketWriter packet(packet_scratch);
+        unsigned int ends[MAX_PLAYERS];
         for(uint8_t i = 0; i < player_set->count(); ++i){
-            decode_string(player_set->at(i).username, packet, offset);
+            if(player_set->get_peer(i))
+                write_snapshot(packet, current, player_set->snapshots.get(player_set->at(i).acked_snapshot), player_set->at(i).input_sequence);
+            ends[i] = packet.size();
         }
-    }
+        if(packet.size() == 0)
+            return;
 
-    void broadcast_player_synch( PlayerSet *player_set, ENetHost *host){
-        packet_create(1);
-        encode( PACKET_PLAYER_SYNCH, packet, offset);   // Packet type
-        encode( player_set->count(), packet, offset); // Specify the player count
-        // For each player, place the required data
-        Player* p;
+        // ENet only stores the pointers, the last packet it destroys frees the data
+        SharedPacketData *shared = (SharedPacketData*)enet_malloc(sizeof(SharedPacketData) + packet.size());
+        shared->references = 1;     // Held while the packets are created
+        memcpy(shared->data(), packet.data(), packet.size());
+        unsigned int start = 0;
+        ENetPacket *peer_packet;
         for(uint8_t i = 0; i < player_set->count(); ++i){
-            p = &player_set->at(i);
-            encode(p->move_mode, packet, offset);
-            encode(p->input_flag, packet, offset);
-            encode_array(p->collision_shape.pos, 3, packet, offset);
-            encode_array(p->collision_shape.rot, 4, packet, offset);
-            encode_array(p->look_rot, 4, packet, offset);
-            encode_array(p->velocity, 3, packet, offset);
+            if(ends[i] == start)
+                continue;
+            peer_packet = enet_packet_create(shared->data() + start, ends[i] - start, packet_flags(delivery) | ENET_PACKET_FLAG_NO_ALLOCATE);
+            peer_packet->userData = shared;
+            peer_packet->freeCallback = destroy_shared_packet;
+            ++shared->references;
+            send_packet(player_set->get_peer(i), delivery, peer_packet);
+            start = ends[i];
         }
-        packet_broadcast
+        release_shared_packet_data(shared);
     }
 
-    void receive_player_synch(PlayerSet *player_set,  ENetPacket *packet){
-        unsigned int offset = 1;
-        uint8_t player_count;
-        decode( player_count, packet, offset); // Specify the player count
-        player_set->reserve(player_count);
+    uint32_t receive_player_synch(PlayerSet *player_set,  ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        SnapshotHeader header;
+        if(!read(r, header) || header.id == 0 || header.count > MAX_PLAYERS)
+            return 0;
 
-        // For each player, place the required data
-        Player *p;
-        uint8_t active_slot = player_set->get_active_slot();
-        for(uint8_t i = 0; i < player_set->count(); ++i){
-            p = &player_set->at(i);
-
-            // Active Player (write fewer predicted or known states)
-            if(i == active_slot){
-                offset += sizeof(p->move_mode);    // Skip move mode
-                offset += sizeof(p->input_flag);    // Skip input flag
-                decode_array(p->collision_shape.pos, 3, packet, offset);
-                decode_array(p->collision_shape.rot, 4, packet, offset);
-                offset += sizeof(p->look_rot);    // Skip look rotation
-                decode_array(p->velocity, 3, packet, offset);
-            }
-            // Other Players
-            else{
-                decode(p->move_mode, packet, offset);
-                decode(p->input_flag, packet, offset);
-                decode_array(p->collision_shape.pos, 3, packet, offset);
-                decode_array(p->collision_shape.rot, 4, packet, offset);
-                decode_array(p->look_rot, 4, packet, offset);
-                decode_array(p->velocity, 3, packet, offset);
-
-            }
+        // Drop snapshots older than the applied one, or that were encoded against one that is no longer kept
+        const Snapshot *baseline = player_set->snapshots.get(header.baseline_id);
+        if(header.id <= player_set->snapshot_id || (header.baseline_id != 0 && !baseline))
+            return 0;
 
+        // Decoded aside so a malformed snapshot does not replace one in the history
+        Snapshot s;
+        s.id = header.id;
+        s.count = header.count;
+        for(uint8_t i = 0; i < s.count; ++i)
+            if(!read_player_delta(r, s.players[i], baseline && i < baseline->count ? &baseline->players[i] : nullptr))
+                return 0;
+        SnapshotTrailer trailer;
+        if(!read(r, trailer))
+            return 0;
 
-        }
+        // The baseline is at least one id older and less than SNAPSHOT_HISTORY older, so it is not replaced
+        player_set->snapshots.add(s.id) = s;
+        player_set->snapshot_id = s.id;
+        // Version 1 servers do not acknowledge inputs, the prediction is kept as is
+        player_set->acked_input = r.version() >= 2 ? trailer.input_ack : player_set->input_sequence;
+        player_set->apply_snapshot(s);
+        return s.id;
     }
 
+    void send_snapshot_ack(uint32_t id, ENetPeer *dest){
+        packet_create(PACKET_SNAPSHOT_ACK)
+        write(packet, AckMessage{id});
+        packet_send
+    }
 
-}
+    bool receive_snapshot_ack(PlayerSet *player_set, Player *p, ENetPacket *packet){
+        PacketReader r = read_header(packet);
+        AckMessage m;
+        // An id that was never sent would hold the baseline above every later valid ack
+        if(!read(r, m) || m.id > player_set->snapshot_id)
+            return false;
+        // Acknowledgements can arrive out of order, only newer ones move the baseline
+        if(m.id > p->acked_snapshot)
+            p->acked_snapshot = m.id;
+        return true;
+    }
 
+
+}
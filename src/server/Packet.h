@@ -9,11 +9,30 @@
 /*
  * Packets are created by calling the packet functions and giving the required args.
  * The packet is then constructed and passed to a connection object.
+ * Each packet starts with its type and the protocol version of the sender, the fields follow (see Serialize.h).
  */
 typedef uint8_t packet_type;
+#define PACKET_HEADER_SIZE 2
 
 namespace Packet{
 
+    /*
+     * Delivery classes of the packet types, each class is sent on its own channel.
+     * Reliable packets are resent until received and are delivered in order.
+     * Sequenced packets are sent once, a packet older than the last one received on the channel is dropped.
+     * State sent every step (input, snapshots) is sequenced, a lost packet is replaced by the next one
+     * instead of holding back everything after it while it is resent.
+     */
+    enum Delivery : uint8_t {
+        DELIVERY_RELIABLE = 0,  // Channel 0
+        DELIVERY_SEQUENCED = 1  // Channel 1
+    };
+    Delivery get_delivery(packet_type type);
+
+    // The type of a received packet, PACKET_INVALID if it has no header or its sender's protocol is too old
+    const packet_type PACKET_INVALID = UINT8_MAX;
+    packet_type get_type(ENetPacket *packet);
+
     /*
      * Server Bound
      * Requests a login using a username and passkey.
@@ -22,7 +41,7 @@ namespace Packet{
      */
     const packet_type PACKET_LOGIN = 0;
     void send_login(std::string &username, std::string &passkey, ENetPeer *dest);
-    void receive_login(std::string &username, std::string &passkey, ENetPacket *packet);
+    bool receive_login(std::string &username, std::string &passkey, ENetPacket *packet);
 
     /*
      * Client Bound
@@ -31,16 +50,18 @@ namespace Packet{
      */
     const packet_type PACKET_KICK = 1;
     void send_kick(std::string &reason, ENetPeer *dest);
-    void receive_kick(std::string &reason, ENetPacket *packet);
+    bool receive_kick(std::string &reason, ENetPacket *packet);
 
     /*
      * Server Bound
      * Sends the input flags of a player to the server.
      * The clients change with key events and send all input flags to the server.
+     * Each step's input has a sequence number, the packet repeats the last INPUT_REDUNDANCY inputs.
+     * The server applies one input per step and echoes the last applied sequence in the snapshots.
      */
     const packet_type PACKET_PLAYER_INPUT = 2;
-    void send_player_input(Player *p, ENetPeer *dest);
-    void receive_player_input(Player *p,  ENetPacket *packet);
+    void send_player_input(PlayerSet *player_set, ENetPeer *dest);
+    bool receive_player_input(Player *p,  ENetPacket *packet);
 
     /*
     * Client Bound
@@ -49,7 +70,7 @@ namespace Packet{
     */
     const packet_type PACKET_PLAYER_STATUS_SYNCH = 3;
     void broadcast_player_status_synch( PlayerSet *player_set, ENetHost *host);
-    void receive_player_status_synch(PlayerSet *player_set,  ENetPacket *packet);
+    bool receive_player_status_synch(PlayerSet *player_set,  ENetPacket *packet);
 
     /*
      * Client Bound
@@ -57,10 +78,24 @@ namespace Packet{
      * Clients read the player data and display it.
      * Clients may predict motion, and generally show one step behind real-time.
      * Armatures are automatically interpolated when calling the interpolate() function.
+     *
+     * The server takes a quantized snapshot of every player each step and sends each client only the fields
+     * that changed since the last snapshot that client acknowledged, or every field if that snapshot is no longer kept.
+     * receive_player_synch returns the id to acknowledge, or 0 if the snapshot was dropped (old or missing its baseline).
+     * Each client's snapshot also holds the sequence of its player's last applied input, see PlayerSet::reconcile().
      */
     const packet_type PACKET_PLAYER_SYNCH = 4;
     void broadcast_player_synch( PlayerSet *player_set, ENetHost *host);
-    void receive_player_synch(PlayerSet *player_set,  ENetPacket *packet);
+    uint32_t receive_player_synch(PlayerSet *player_set,  ENetPacket *packet);
+
+    /*
+     * Server Bound
+     * Acknowledges a received snapshot, the server delta encodes the next snapshots for this client against it.
+     * Ids the server has not sent yet are rejected.
+     */
+    const packet_type PACKET_SNAPSHOT_ACK = 5;
+    void send_snapshot_ack(uint32_t id, ENetPeer *dest);
+    bool receive_snapshot_ack(PlayerSet *player_set, Player *p, ENetPacket *packet);
 };
 
 
@@ -0,0 +1,194 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <type_traits>
+#include <algorithm>
+
+/*
+ * Packet serialization.
+ * Messages list their fields in a static fields() function, the fields are written in that order with no padding.
+ * Fields added later are appended with the protocol version that introduced them: a reader skips fields newer than
+ * the sender's version, keeping their defaults, and ignores trailing bytes from a newer sender.
+ * So only the last message of a packet can gain fields, a message followed by more data or repeated in a vector cannot.
+ * NOTE Does not support inter-system endian changes, all systems must be little endian.
+ */
+typedef std::vector<uint8_t> PacketBuffer;
+
+/*
+ * Appends to a buffer, the buffer keeps its capacity so a reused buffer only allocates while growing
+ */
+class PacketWriter {
+    PacketBuffer &buffer;
+    unsigned int offset = 0;
+
+public:
+    inline PacketWriter( PacketBuffer &buffer ) : buffer( buffer ) {}
+
+    // Pointer to the next size bytes, which are then written
+    inline uint8_t* reserve( unsigned int size ){
+        if( buffer.size() < offset + size )
+            buffer.resize( offset + size );
+        uint8_t *data = buffer.data() + offset;
+        offset += size;
+        return data;
+    }
+
+    inline void write_bytes( const void *data, unsigned int size ){
+        memcpy( reserve( size ), data, size );
+    }
+
+    inline const uint8_t* data() const {
+        return buffer.data();
+    }
+
+    // Bytes written so far
+    inline unsigned int size() const {
+        return offset;
+    }
+};
+
+/*
+ * Reads a received packet in place, every read is checked against the length.
+ * A read past the end fails and leaves the reader failed, so a message can be read whole and checked once.
+ */
+class PacketReader {
+    const uint8_t *data;
+    unsigned int length;
+    unsigned int offset = 0;
+    uint8_t sender_version;
+    bool valid = true;
+
+public:
+    inline PacketReader( const uint8_t *data, unsigned int length, uint8_t sender_version )
+        : data( data ), length( length ), sender_version( sender_version ) {}
+
+    // Pointer to the next size bytes inside the packet, nullptr if the packet is too short
+    inline const uint8_t* view( unsigned int size ){
+        if( !valid || size > length - offset ){
+            valid = false;
+            return nullptr;
+        }
+        const uint8_t *p = data + offset;
+        offset += size;
+        return p;
+    }
+
+    inline bool read_bytes( void *dest, unsigned int size ){
+        const uint8_t *p = view( size );
+        if( p )
+            memcpy( dest, p, size );
+        return p != nullptr;
+    }
+
+    inline bool ok() const {
+        return valid;
+    }
+
+    // Protocol version of the sender
+    inline uint8_t version() const {
+        return sender_version;
+    }
+};
+
+/*
+ * A message field, since is the protocol version that added it
+ */
+template<typename C, typename T> struct Field {
+    T C::*member;
+    uint8_t since;
+};
+
+template<typename C, typename T> constexpr Field<C, T> field( T C::*member, uint8_t since = 1 ){
+    return { member, since };
+}
+
+template<typename T, typename = void> struct Serializer;
+
+// A type is a message if it lists its fields
+template<typename T, typename = void> struct is_message : std::false_type {};
+template<typename T> struct is_message<T, std::void_t<decltype( T::fields() )>> : std::true_type {};
+
+// Plain values and fixed-size arrays are copied as is
+template<typename T> struct Serializer<T, std::enable_if_t<std::is_trivially_copyable_v<T> && !is_message<T>::value>> {
+    static void write( PacketWriter &w, const T &t ){
+        w.write_bytes( &t, sizeof( T ) );
+    }
+    static bool read( PacketReader &r, T &t ){
+        return r.read_bytes( &t, sizeof( T ) );
+    }
+};
+
+// Strings of up to 255 chars, prefixed by their length
+template<> struct Serializer<std::string> {
+    static void write( PacketWriter &w, const std::string &str ){
+        uint8_t length = std::min<size_t>( str.size(), UINT8_MAX );
+        w.write_bytes( &length, 1 );
+        w.write_bytes( str.data(), length );
+    }
+    static bool read( PacketReader &r, std::string &str ){
+        uint8_t length;
+        const char *chars;
+        if( !r.read_bytes( &length, 1 ) || !( chars = (const char*)r.view( length ) ) )
+            return false;
+        str.assign( chars, length );
+        return true;
+    }
+};
+
+// Vectors of up to 255 values, prefixed by their count
+template<typename T> struct Serializer<std::vector<T>> {
+    static void write( PacketWriter &w, const std::vector<T> &v ){
+        uint8_t count = std::min<size_t>( v.size(), UINT8_MAX );
+        w.write_bytes( &count, 1 );
+        for( uint8_t i = 0; i < count; ++i )
+            Serializer<T>::write( w, v[i] );
+    }
+    static bool read( PacketReader &r, std::vector<T> &v ){
+        uint8_t count;
+        if( !r.read_bytes( &count, 1 ) )
+            return false;
+        v.resize( count );
+        for( uint8_t i = 0; i < count; ++i )
+            if( !Serializer<T>::read( r, v[i] ) )
+                return false;
+        return true;
+    }
+};
+
+// Messages write each field in order
+template<typename T> struct Serializer<T, std::enable_if_t<is_message<T>::value>> {
+    static void write( PacketWriter &w, const T &t ){
+        std::apply( [&]( const auto&... f ){
+            ( write_field( w, t.*( f.member ) ), ... );
+        }, T::fields() );
+    }
+    static bool read( PacketReader &r, T &t ){
+        // Stops at the first failed field, fields newer than the sender keep their value
+        return std::apply( [&]( const auto&... f ){
+            return ( ( f.since > r.version() || read_field( r, t.*( f.member ) ) ) && ... );
+        }, T::fields() );
+    }
+
+private:
+    template<typename F> static void write_field( PacketWriter &w, const F &f ){
+        Serializer<F>::write( w, f );
+    }
+    template<typename F> static bool read_field( PacketReader &r, F &f ){
+        return Serializer<F>::read( r, f );
+    }
+};
+
+template<typename T> inline void write( PacketWriter &w, const T &t ){
+    Serializer<T>::write( w, t );
+}
+
+template<typename T> inline bool read( PacketReader &r, T &t ){
+    return Serializer<T>::read( r, t );
+}
+
+#endif // SERIALIZE_H
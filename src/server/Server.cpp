@@ -6,6 +6,7 @@
 #include "Scene.h"
 #include "ServerConfig.h"
 #include "Packet.h"
+#include "Profiler.h"
 
 // Function for pthread to use when starting a server
 void *server_run_func( void *arg ) {
@@ -43,6 +44,7 @@ void Server::run() {
 
     // Initialize the Scene
     scene.init_server(this);
+    Profiler::set_thread_name("Server");
 
     puts("Server: Initialized.");
     fflush(stdout);
@@ -60,11 +62,14 @@ void Server::run() {
 
 
         if(updates > 0){
+            PROFILE_ZONE("Server::tick");
+
             // Poll client signals
             connection.poll_packets();
 
             // Update the scene using the step count
             for( int i = 0; i < updates; ++i ) {
+                scene.player_set.apply_inputs();
                 scene.update( );
             }
 
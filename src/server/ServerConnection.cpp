@@ -2,6 +2,7 @@
 #include "Packet.h"
 #include <cstdio>
 #include "Server.h"
+#include "Profiler.h"
 
 void ServerConnection::start_host() {
     _ENetAddress address;
@@ -10,7 +11,7 @@ void ServerConnection::start_host() {
     host_server = enet_host_create(
             &address,
             MAX_PLAYERS, // Maximum number of clients
-            2,           // Number of channels
+            CONNECTION_CHANNELS, // Number of channels
             0,           // Allow any amount of incoming bandwidth
             0            // Allow any amount of outgoing bandwidth
         );
@@ -23,6 +24,7 @@ void ServerConnection::start_host() {
 }
 
 void ServerConnection::poll_packets() {
+    PROFILE_ZONE("ServerConnection::poll_packets");
     ENetEvent event;
     while( enet_host_service( host_server, &event, 0 ) > 0 ) {
         char address_name[16];
@@ -60,14 +62,15 @@ void ServerConnection::poll_packets() {
 }
 
 void ServerConnection::interpret_packets( ENetPacket *packet, ENetPeer *peer ) {
-    packet_type type = ( uint8_t )packet->data[0];
+    packet_type type = Packet::get_type( packet );
     Player* p = reinterpret_cast<Player*>(peer->data);
 
     switch( type ) {
         case Packet::PACKET_LOGIN: {
             //TEST this just checks that you have the right name
             std::string username, passkey;
-            Packet::receive_login( username, passkey, packet );
+            if( !Packet::receive_login( username, passkey, packet ) )
+                break;
             printf( "Server: Validating user of name %s and passkey %s\n", username.c_str(), passkey.c_str() );
             fflush( stdout );
             // Call the player set login function, it will send packet responses
@@ -76,7 +79,14 @@ void ServerConnection::interpret_packets( ENetPacket *packet, ENetPeer *peer ) {
         }
 
         case Packet::PACKET_PLAYER_INPUT: {
-            Packet::receive_player_input(p, packet);
+            if(p)
+                Packet::receive_player_input(p, packet);
+            break;
+        }
+
+        case Packet::PACKET_SNAPSHOT_ACK: {
+            if(p)
+                Packet::receive_snapshot_ack(&owner->scene.player_set, p, packet);
             break;
         }
     }
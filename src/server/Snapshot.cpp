@@ -0,0 +1,71 @@
+#include "Snapshot.h"
+
+#include <cmath>
+
+// Lower bound and size of the position range of each axis
+static const float position_min[3] = {
+    -SNAPSHOT_POSITION_MARGIN,
+    SNAPSHOT_HEIGHT_MIN,
+    -SNAPSHOT_POSITION_MARGIN
+};
+static const float position_range[3] = {
+    TERRAIN_DIM * TERRAIN_SCALE + 2 * SNAPSHOT_POSITION_MARGIN,
+    SNAPSHOT_HEIGHT_MAX - SNAPSHOT_HEIGHT_MIN,
+    TERRAIN_DIM * TERRAIN_SCALE + 2 * SNAPSHOT_POSITION_MARGIN
+};
+
+uint16_t Quantize::position(float v, unsigned int axis){
+    float t = glm_clamp((v - position_min[axis]) / position_range[axis], 0, 1);
+    return (uint16_t)floorf(t * UINT16_MAX + .5f);
+}
+
+float Quantize::position(uint16_t q, unsigned int axis){
+    return position_min[axis] + q * (position_range[axis] / UINT16_MAX);
+}
+
+int16_t Quantize::velocity(float v){
+    float s = glm_clamp(v * SNAPSHOT_VELOCITY_SCALE, -INT16_MAX, INT16_MAX);
+    return (int16_t)floorf(s + .5f);
+}
+
+float Quantize::velocity(int16_t q){
+    return q * (1.0f / SNAPSHOT_VELOCITY_SCALE);
+}
+
+static constexpr float ROTATION_BOUND = 0.70710678f;   // 1/sqrt(2), no other component can be larger than the largest
+static constexpr uint32_t ROTATION_MAX = 1023;         // 10 bits per component
+
+uint32_t Quantize::rotation(const versor q){
+    // Find the largest component, q and -q are the same rotation so it is made positive
+    unsigned int largest = 0;
+    for(unsigned int i = 1; i < 4; ++i)
+        if(fabsf(q[i]) > fabsf(q[largest]))
+            largest = i;
+    float sign = q[largest] < 0 ? -1 : 1;
+
+    uint32_t packed = largest, c;
+    float t;
+    for(unsigned int i = 0; i < 4; ++i){
+        if(i == largest)
+            continue;
+        t = glm_clamp((q[i] * sign / ROTATION_BOUND + 1) * .5f, 0, 1);
+        c = (uint32_t)floorf(t * ROTATION_MAX + .5f);
+        packed = (packed << 10) | c;
+    }
+    return packed;
+}
+
+void Quantize::rotation(uint32_t packed, versor dest){
+    unsigned int largest = packed >> 30;
+    float sum = 0;
+
+    // Components were packed in order, so the last one is in the lowest bits
+    for(int i = 3; i >= 0; --i){
+        if((unsigned int)i == largest)
+            continue;
+        dest[i] = ((packed & ROTATION_MAX) / (float)ROTATION_MAX * 2 - 1) * ROTATION_BOUND;
+        sum += dest[i] * dest[i];
+        packed >>= 10;
+    }
+    dest[largest] = sqrtf(fmaxf(1 - sum, 0));
+}
@@ -0,0 +1,74 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "definitions.h"
+#include <inttypes.h>
+#include <cglm/cglm.h>
+
+/*
+ * Quantization of replicated values, the server and client must agree on every range.
+ * Positions are relative to the terrain bounds with a margin, 16 bits per axis gives under a centimeter on x and z.
+ * Rotations use the smallest three scheme: the largest component is dropped and rebuilt from the unit length,
+ * the other three are in [-1/sqrt(2), 1/sqrt(2)] and take 10 bits each, the index of the dropped one takes 2.
+ */
+namespace Quantize {
+    uint16_t position(float v, unsigned int axis);
+    float position(uint16_t q, unsigned int axis);
+
+    int16_t velocity(float v);
+    float velocity(int16_t q);
+
+    uint32_t rotation(const versor q);
+    void rotation(uint32_t packed, versor dest);
+};
+
+/*
+ * The quantized state of one player
+ */
+struct PlayerSnapshot {
+    uint8_t move_mode = 0;
+    uint16_t input_flag = 0;
+    uint16_t pos[3] = {};
+    uint32_t rot = 0;
+    uint32_t look_rot = 0;
+    int16_t velocity[3] = {};
+};
+
+/*
+ * Every player at one server step, id 0 is never used so it can mark a missing snapshot
+ */
+struct Snapshot {
+    uint32_t id = 0;
+    uint8_t count = 0;
+    PlayerSnapshot players[MAX_PLAYERS];
+};
+
+/*
+ * The last SNAPSHOT_HISTORY snapshots, indexed by id.
+ * The server keeps the snapshots it sent to delta encode against the last one each client acknowledged,
+ * the client keeps the snapshots it received to decode those deltas.
+ */
+class SnapshotHistory {
+    Snapshot snapshots[SNAPSHOT_HISTORY];
+
+public:
+    // Slot for a new snapshot, replaces the one SNAPSHOT_HISTORY ids older
+    inline Snapshot& add(uint32_t id){
+        Snapshot &s = snapshots[id % SNAPSHOT_HISTORY];
+        s.id = id;
+        return s;
+    }
+
+    // Returns nullptr if the snapshot was never stored or has been replaced
+    inline const Snapshot* get(uint32_t id) const {
+        const Snapshot &s = snapshots[id % SNAPSHOT_HISTORY];
+        return id != 0 && s.id == id ? &s : nullptr;
+    }
+
+    inline void clear(){
+        for(Snapshot &s : snapshots)
+            s.id = 0;
+    }
+};
+
+#endif // SNAPSHOT_H